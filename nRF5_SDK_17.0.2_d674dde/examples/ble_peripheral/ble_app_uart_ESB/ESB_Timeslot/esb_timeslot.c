@@ -14,6 +14,10 @@
 #include "nrf_log_ctrl.h"
 #include "nrf_log_default_backends.h"
 #include "nrf_sdh_soc.h"
+#include "nrf_sdh_ble.h"
+#include "app_scheduler.h"
+#include "app_timer.h"
+#include "nrf_atomic.h"
 #define TIMESLOT_BEGIN_IRQn         COMP_LPCOMP_IRQn             /**< Re-used LPCOMP interrupt for processing the beginning of timeslot. */
 #define TIMESLOT_BEGIN_IRQHandler   COMP_LPCOMP_IRQHandler       /**< The IRQ handler of LPCOMP interrupt */
 #define TIMESLOT_BEGIN_IRQPriority  1                       /**< Interrupt priority of @ref TIMESLOT_BEGIN_IRQn. */
@@ -26,31 +30,245 @@
 #define UESB_RX_HANDLE_IRQHandler   WDT_IRQHandler          /**< The IRQ handler of WDT interrupt */
 #define UESB_RX_HANDLE_IRQPriority  3                       /**< Interrupt priority of @ref UESB_RX_HANDLE_IRQn. */
 
+#define TIMESLOT_WAKE_IRQn          PDM_IRQn                /**< Re-used PDM interrupt for requesting a timeslot when the session is idle. */
+#define TIMESLOT_WAKE_IRQHandler    PDM_IRQHandler          /**< The IRQ handler of PDM interrupt */
+#define TIMESLOT_WAKE_IRQPriority   6                       /**< Interrupt priority of @ref TIMESLOT_WAKE_IRQn, low enough to call the SoftDevice. */
+
 #define MAX_TX_ATTEMPTS             10                      /**< Maximum attempt before discarding the packet (the number of trial = MAX_TX_ATTEMPTS x retransmit_count, if timeslot is large enough) */
-#define TS_LEN_US                   (5000UL)                /**< Length of timeslot to be requested. */
-#define TX_LEN_EXTENSION_US         (5000UL)                /**< Length of timeslot to be extended. */
+#define MAX_TX_CHUNKS               8                       /**< Maximum number of ESB payloads a string passed to @ref esb_timeslot_send_str is split into. */
+#define TX_CONTROL_FIFO_SIZE        64                      /**< Size of each pipe's Tx FIFO for ESB_TIMESLOT_CLASS_CONTROL in bytes, must be a power of two. */
+#define TX_TELEMETRY_FIFO_SIZE      128                     /**< Size of each pipe's Tx FIFO for ESB_TIMESLOT_CLASS_TELEMETRY in bytes, must be a power of two. */
+#define TX_BULK_FIFO_SIZE           512                     /**< Size of each pipe's Tx FIFO for ESB_TIMESLOT_CLASS_BULK in bytes, must be a power of two and hold the longest string. */
+#define TX_TELEMETRY_WEIGHT         2                       /**< Default share of ESB_TIMESLOT_CLASS_TELEMETRY, see @ref esb_timeslot_class_weight_set. */
+#define TX_BULK_WEIGHT              1                       /**< Default share of ESB_TIMESLOT_CLASS_BULK, see @ref esb_timeslot_class_weight_set. */
+#define RX_FIFO_SIZE                512                     /**< Size of the Rx FIFO in bytes, must be a power of two. */
+#define RX_DISPATCH_BATCH           4                       /**< Number of received packets taken from the Rx FIFO at a time in main context. */
+#define TS_LEN_MIN_US               (5000UL)                /**< Shortest timeslot to be requested, used when there is nothing to send. */
+#define TS_LEN_MAX_US               (5000UL)                /**< Longest timeslot to be requested. Equal to TS_LEN_MIN_US for a fixed length, raise it to size timeslots from the Tx backlog. */
+#define TX_LEN_EXTENSION_MIN_US     (5000UL)                /**< Shortest timeslot extension. */
+#define TX_LEN_EXTENSION_MAX_US     (5000UL)                /**< Longest timeslot extension. Equal to TX_LEN_EXTENSION_MIN_US for a fixed length, raise it to size extensions from the Tx backlog. */
+#define TX_LEN_EXTENSION_GROWTH_MAX 3                       /**< Times the extension length may double while a Tx backlog persists. */
+#define TX_RAMP_UP_US               (130UL)                 /**< Radio ramp-up time before each transmit attempt. */
+#define TX_FRAME_OVERHEAD_BYTES     9                       /**< Preamble, address, packet control field and CRC bytes sent with each ESB payload. */
+#define TX_AIRTIME_INIT_US          (600UL)                 /**< Assumed airtime of a transmit attempt until one has been measured. */
 #define TS_SAFETY_MARGIN_US         (700UL)                 /**< The timeslot activity should be finished with this much to spare. */
 #define TS_EXTEND_MARGIN_US         (2000UL)                /**< Margin reserved for extension processing. */
+#define TS_PERIOD_GUARD_US          (1000UL)                /**< In periodic mode, a timeslot ends at least this long before the next one starts. */
+#define TS_PERIOD_MAX_MISSES        4                       /**< In periodic mode, blocked or cancelled timeslots in a row before falling back to an earliest request. */
+#define TS_EARLIEST_TIMEOUT_US      500000                  /**< Timeout of earliest requests while they are rarely blocked. */
+#define TS_EARLIEST_TIMEOUT_MAX_US  4000000                 /**< Timeout of earliest requests while they are always blocked. */
+#define TS_EARLIEST_TIMEOUT_MIN_US  20000                   /**< Shortest timeout of earliest requests made for old queued packets. */
+#define TS_RETRY_BACKOFF_MIN_MS     5                       /**< Wait before re-requesting after the second blocked request in a row. */
+#define TS_RETRY_BACKOFF_MAX_MS     80                      /**< Longest wait, the wait doubles with each further blocked request. */
+#define TS_ESCALATE_DEPTH_DEFAULT   1024                    /**< Default Tx backlog in bytes above which timeslots are requested at high priority. */
+#define TS_ESCALATE_AGE_MS_DEFAULT  200                     /**< Default age in ms of the oldest queued packet above which timeslots are requested at high priority. */
+#define TS_BLE_EVENT_LEN_US         (NRF_SDH_BLE_GAP_EVENT_LENGTH * UNIT_1_25_MS) /**< Radio time reserved for each BLE connection event. */
+#define TS_BLE_REQUEST_LEAD_US      (1500UL)                /**< A timeslot placed between BLE connection events starts at least this long after it is requested. */
+#define TS_BLE_DRIFT_PPM            500                     /**< Worst case drift between the sleep clocks of the BLE peers. */
+#define TS_BLE_ANCHOR_MAX_AGE_US    (30000000UL)            /**< Connection event timing older than this is not used to place timeslots. */
+#define TX_DEADLINE_MAX             8                       /**< Messages with a deadline that can be queued at a time. */
+#define TS_DEADLINE_URGENT_US       (50000UL)               /**< Timeslots are requested at high priority when a deadline is closer than this. */
+#define TS_DEADLINE_TIMEOUT_MIN_US  (1000UL)                /**< Shortest timeout of an earliest request made for a deadline. */
+#define TS_DEADLINE_START_US        (2000UL)                /**< Shortest time to get a timeslot when none is running, to check deadlines. */
+#define TX_DEADLINE_MAX_MS          60000                   /**< Longest deadline, well within the RTC range. */
+#define TS_LEN_TOTAL_MAX_US         (128000000UL - 1UL)     /**< Longest a timeslot can be made with extensions. */
+#define TS_RENEW_THRESHOLD_US       (TS_LEN_TOTAL_MAX_US - 2 * TX_LEN_EXTENSION_MAX_US) /**< Extended length after which the timeslot is renewed at the next packet boundary. */
+#define TS_RENEW_TRIGGER_US         (10UL)                  /**< Delay from deciding to end a timeslot early to the end-of-timeslot timeout. */
+#define TS_RECOVER_BACKOFF_MIN_MS   10                      /**< First wait before reopening a radio session that went idle unexpectedly. */
+#define TS_RECOVER_BACKOFF_MAX_MS   1000                    /**< Longest wait, the wait doubles after each failed attempt. */
+#define RX_WINDOW_MIN_US            (250UL)                 /**< Shortest Rx window, enough for ramp-up and one packet. */
+#define RX_PERIOD_MAX_US            (10000000UL)            /**< Longest distance between Rx windows. */
+#define TS_TIME_SAMPLE_INTERVAL_MS  60000                   /**< Interval of the periodic sampling of long running intervals, well within the 1024 s wrap of the RTC counter. */
+#define RADIO_ERRATA_182_REG        (*(volatile uint32_t *)0x4000173CUL)    /**< Register of the nRF52832 rev 2 errata 182 workaround. nrf_esb_init does not expose it, so this copies the one in nrf_esb.c of nRF5 SDK 17.0.2 and must be checked against it when the SDK is updated. */
+#define RADIO_ERRATA_182_BIT        (1UL << 10)             /**< Bit set in RADIO_ERRATA_182_REG, see there. */
 
 
 static volatile enum
 {
     STATE_IDLE,                     /**< Default state. */
+    STATE_READY,                 /**< UESB initialized, neither receiving nor transmitting. */
     STATE_RX,                    /**< Waiting for packets. */
     STATE_TX                     /**< Trying to transmit packet. */
 } m_state = STATE_IDLE;
 
+static volatile enum
+{
+    TX_RESULT_NONE,                 /**< No transmission has finished since the last check. */
+    TX_RESULT_SUCCESS,              /**< Packet in flight was acknowledged. */
+    TX_RESULT_FAILED                /**< Packet in flight ran out of retransmits. */
+} m_tx_result = TX_RESULT_NONE;
+
 
 /** Constants for timeslot API */
 static nrf_radio_request_t          m_timeslot_request;     /**< Persistent request structure for softdevice. */
 static nrf_esb_config_t             nrf_esb_config;         /**< Configuration structure for nrf_esb initialization. */
 static ut_data_handler_t            m_evt_handler = 0;      /**< Event handler which passes received data to application. */
-static fifo_t                       m_transmit_fifo;        /**< FIFO buffer for Tx data. */
+FIFO_ARRAY_DEF(m_tx_control_fifos, NRF_ESB_PIPE_COUNT, TX_CONTROL_FIFO_SIZE);       /**< FIFO buffers for Tx data of ESB_TIMESLOT_CLASS_CONTROL, one per pipe. */
+FIFO_ARRAY_DEF(m_tx_telemetry_fifos, NRF_ESB_PIPE_COUNT, TX_TELEMETRY_FIFO_SIZE);   /**< FIFO buffers for Tx data of ESB_TIMESLOT_CLASS_TELEMETRY, one per pipe. */
+FIFO_ARRAY_DEF(m_tx_bulk_fifos, NRF_ESB_PIPE_COUNT, TX_BULK_FIFO_SIZE);             /**< FIFO buffers for Tx data of ESB_TIMESLOT_CLASS_BULK, one per pipe. */
+STATIC_ASSERT(TX_BULK_FIFO_SIZE >= MAX_TX_CHUNKS * FIFO_PKT_REC_LEN(NRF_ESB_MAX_PAYLOAD_LENGTH));
+FIFO_DEF(m_receive_fifo, RX_FIFO_SIZE);                     /**< FIFO buffer for Rx data waiting to be passed to the application. */
+static volatile bool                m_rx_dispatch_pending = false;  /**< Whether an Rx dispatch is queued in app_scheduler. */
+static esb_timeslot_stats_t         m_stats;                /**< Statistics, see @ref esb_timeslot_stats_get. */
+
+/**@brief Retry state of a pipe within a traffic class.
+ */
+typedef struct
+{
+    fifo_pkt_view_t view;           /**< Packet last handed to UESB. */
+    uint32_t        attempts;       /**< Tx retry counter of view. */
+} tx_pipe_t;
+
+/**@brief Transmit queues and scheduling state of a traffic class.
+ */
+typedef struct
+{
+    fifo_t *        p_fifos;        /**< Tx FIFOs of the class, one per pipe. */
+    tx_pipe_t       pipes[NRF_ESB_PIPE_COUNT];
+    uint32_t        rr_pipe;        /**< Pipe to look at first for the next packet. */
+    uint32_t        weight;         /**< Deficit round robin quantum in ESB payloads. Not used for ESB_TIMESLOT_CLASS_CONTROL. */
+    uint32_t        deficit;        /**< Payload bytes the class may still send in its current round. */
+    uint32_t        depth_time;     /**< RTC time of the latest Tx FIFO depth sample. */
+    uint32_t        depth;          /**< Bytes in all Tx FIFOs of the class at the latest sample. */
+    uint64_t        depth_area;     /**< Sum of depth multiplied by RTC ticks, for the time-weighted average. */
+    uint64_t        depth_ticks;    /**< RTC ticks covered by depth_area. */
+    uint64_t        delay_sum_us;   /**< Sum of the queueing delays of delay_cnt packets. */
+    uint32_t        delay_cnt;      /**< Number of packets in delay_sum_us. */
+    esb_timeslot_overflow_policy_t policy;  /**< What to do when a Tx FIFO of the class is full. */
+    uint32_t        block_timeout_ticks;    /**< Longest wait for Tx FIFO space with @ref ESB_TIMESLOT_OVERFLOW_BLOCK. */
+} tx_class_t;
+
+static tx_class_t                   m_tx_classes[ESB_TIMESLOT_CLASS_COUNT] =
+{
+    [ESB_TIMESLOT_CLASS_CONTROL]   = { .p_fifos = m_tx_control_fifos },
+    [ESB_TIMESLOT_CLASS_TELEMETRY] = { .p_fifos = m_tx_telemetry_fifos, .weight = TX_TELEMETRY_WEIGHT },
+    [ESB_TIMESLOT_CLASS_BULK]      = { .p_fifos = m_tx_bulk_fifos,      .weight = TX_BULK_WEIGHT },
+};                                                          /**< Tx state per traffic class. */
+
+/**@brief A queued message with a deadline.
+ */
+typedef struct
+{
+    uint32_t             deadline;  /**< RTC time the message must be delivered by. */
+    uint32_t             id;        /**< Message identifier stored with each of its packets. */
+    uint8_t              chunks;    /**< Packets of the message not delivered yet, 0 if the entry is free. */
+    uint8_t              pipe;      /**< Pipe of the message. */
+    esb_timeslot_class_t tx_class;  /**< Traffic class of the message. */
+} tx_deadline_t;
+
+static tx_deadline_t                m_tx_deadlines[TX_DEADLINE_MAX];    /**< Queued messages with a deadline. */
+static nrf_atomic_u32_t             m_tx_msg_id;                        /**< Identifier of the latest queued message. */
+
+/**@brief RADIO registers set up by UESB, saved once and written back at the start of timeslots.
+ *
+ * @details The SoftDevice uses the RADIO between timeslots. The rest of the UESB state (FIFOs,
+ *          PPI, system timer) is left alone, so restoring these, and the errata workaround applied
+ *          by nrf_esb_init, is all that is needed to resume.
+ */
+typedef struct
+{
+    uint32_t txpower;
+    uint32_t mode;
+#ifdef NRF52_SERIES
+    uint32_t modecnf0;
+#endif
+    uint32_t pcnf0;
+    uint32_t pcnf1;
+    uint32_t base0;
+    uint32_t base1;
+    uint32_t prefix0;
+    uint32_t prefix1;
+    uint32_t txaddress;
+    uint32_t rxaddresses;
+    uint32_t crccnf;
+    uint32_t crcpoly;
+    uint32_t crcinit;
+    uint32_t tifs;
+    uint32_t frequency;
+} radio_cfg_t;
+
+static radio_cfg_t                  m_radio_cfg;            /**< Saved RADIO configuration, valid while m_esb_parked. */
+static bool                         m_esb_parked = false;   /**< Whether UESB was left initialized and idle at the end of the latest timeslot. */
+static bool                         m_first_tx_pending;     /**< Whether no packet was handed to UESB yet in this timeslot. */
+static bool                         m_slot_resumed;         /**< Whether UESB was resumed from m_radio_cfg in this timeslot. */
+static nrf_atomic_u32_t             m_end_deferred = 0;     /**< Set while stopping UESB waits for the result of the packet in flight. */
+static volatile bool                m_esb_cut = false;      /**< Whether the timeslot ended with a packet in flight, so UESB must be disabled before it is initialized again. */
+static uint8_t                      m_pid_class[NRF_ESB_PIPE_COUNT];    /**< Class of the packet last handed to UESB per pipe, plus 1. 0 when UESB has not sent on the pipe since it was initialized. */
+
+static esb_timeslot_class_t         m_tx_class;             /**< Class of the packet last handed to UESB. */
+static uint32_t                     m_tx_pipe;              /**< Pipe of the packet last handed to UESB. */
+static esb_timeslot_class_t         m_drr_class = ESB_TIMESLOT_CLASS_TELEMETRY;    /**< Class whose deficit round robin turn it is. */
+APP_TIMER_DEF(m_time_sample_timer);                         /**< Samples long running intervals before the RTC counter wraps. */
 
 static nrf_radio_signal_callback_return_param_t signal_callback_return_param;   /**< Return parameter structure to timeslot callback. */
 static uint32_t                     m_total_timeslot_length = 0;                /**< Timeslot length. */
-static uint32_t                     m_tx_attempts = 0;                          /**< Tx retry counter. */
+static uint32_t                     m_timeslot_len_us = TS_LEN_MIN_US;          /**< Length of the latest timeslot request. */
+static uint32_t                     m_extension_len_us = TX_LEN_EXTENSION_MIN_US;   /**< Length of the latest extension request. */
+static volatile uint32_t            m_tx_airtime_us = TX_AIRTIME_INIT_US;       /**< Running average of the airtime of a transmit attempt, retransmits included. */
+static uint32_t                     m_tx_rec_len_avg = FIFO_PKT_REC_LEN(NRF_ESB_MAX_PAYLOAD_LENGTH);   /**< Running average of the Tx FIFO record length of sent packets. */
+static uint32_t                     m_tx_start_time;                            /**< TIMER0 time the packet in flight was handed to UESB. */
+static uint32_t                     m_period_us = 0;                            /**< Distance between timeslots in periodic mode, 0 for earliest mode. */
+static bool                         m_period_anchored = false;                  /**< Whether a timeslot has started since the latest earliest request, so normal requests can follow. */
+static uint32_t                     m_period_misses = 0;                        /**< Periodic timeslots blocked or cancelled since the latest one that started. */
+static uint32_t                     m_slot_start_time;                          /**< RTC time the latest timeslot started. */
+static uint32_t                     m_escalate_depth = TS_ESCALATE_DEPTH_DEFAULT;   /**< Tx backlog in bytes that raises the request priority, 0 to ignore the backlog. */
+static uint32_t                     m_escalate_age_ticks = APP_TIMER_TICKS(TS_ESCALATE_AGE_MS_DEFAULT); /**< Packet age in RTC ticks that raises the request priority, 0 to ignore the age. */
+static bool                         m_escalated = false;                        /**< Whether timeslots are requested at high priority. */
+static bool                         m_slot_escalated = false;                   /**< Whether the current timeslot was requested at high priority. */
+static bool                         m_on_demand = false;                        /**< Whether timeslots are only requested when there is something to do. */
+static volatile bool                m_session_idle = false;                     /**< Whether the session has no timeslot requested, in on-demand mode. */
+static volatile bool                m_rx_due = false;                           /**< Whether an Rx window is due, in on-demand mode. */
+static uint32_t                     m_idle_since;                               /**< RTC time the session went idle. */
+static bool                         m_session_open = false;                     /**< Whether a radio session is open. */
+static uint32_t                     m_session_time;                             /**< RTC time up to which session_time_us is counted. */
+APP_TIMER_DEF(m_rx_window_timer);                                               /**< Opens Rx windows in on-demand mode. */
+static volatile bool                m_renew = false;                            /**< Whether to end the timeslot at the next packet boundary and request a new one. */
+static bool                         m_renew_gap = false;                        /**< Whether the next timeslot start ends a renewal gap. */
+static uint32_t                     m_renew_end_time;                           /**< RTC time the renewed timeslot ended. */
+static uint32_t                     m_blocked_permille = 0;                     /**< Running average of the share of earliest requests blocked. */
+static uint32_t                     m_blocked_streak = 0;                       /**< Blocked requests since the latest timeslot start. */
+static volatile bool                m_retry_wait = false;                       /**< Whether a re-request is being delayed. */
+static volatile bool                m_retry_due = false;                        /**< Whether the delayed re-request should be made. */
+static bool                         m_request_pending = false;                  /**< Whether m_request_time is set. */
+static uint32_t                     m_request_time;                             /**< RTC time of the first request since the latest timeslot start. */
+APP_TIMER_DEF(m_retry_timer);                                                   /**< Ends the wait before a re-request. */
+static volatile bool                m_session_lost = false;                     /**< Whether the session went idle unexpectedly and has to be reopened. */
+static volatile bool                m_recover_wait = false;                     /**< Whether the recovery backoff is running. */
+static uint32_t                     m_recover_backoff_ms = TS_RECOVER_BACKOFF_MIN_MS; /**< Wait before the next recovery attempt. */
+static bool                         m_outage = false;                           /**< Whether no timeslot has started since the session was lost. */
+static uint32_t                     m_outage_start;                             /**< RTC time up to which the outage in progress is counted in m_outage_us. */
+static uint32_t                     m_outage_us;                                /**< Length of the outage in progress up to m_outage_start. */
+APP_TIMER_DEF(m_recover_timer);                                                 /**< Ends the recovery backoff. */
+static uint32_t                     m_rx_window_us = 0;                         /**< Length of Rx windows, see @ref esb_timeslot_rx_schedule_set. */
+static uint32_t                     m_rx_period_us = 0;                         /**< Distance between Rx window starts, 0 to listen whenever idle. */
+static uint32_t                     m_rx_window_ticks;                          /**< m_rx_window_us in RTC ticks. */
+static uint32_t                     m_rx_period_ticks;                          /**< m_rx_period_us in RTC ticks. */
+static bool                         m_rx_sync = false;                          /**< Whether Rx windows follow the time packets are received. */
+static uint32_t                     m_rx_anchor;                                /**< RTC time of an Rx window start. */
+static volatile uint32_t            m_rx_sync_time;                             /**< RTC time of the latest received packet, when m_rx_sync_pending is set. */
+static volatile bool                m_rx_sync_pending = false;                  /**< Whether m_rx_anchor should move to m_rx_sync_time. */
+static uint32_t                     m_rx_listen_start;                          /**< RTC time Rx was started. */
+static uint32_t                     m_rx_cfg_pkts;                              /**< Received packet count when the Rx schedule was set. */
+static bool                         m_rx_required = false;                      /**< Whether timeslots are extended to keep listening with nothing to send. */
+static uint8_t                      m_tx_payload_len;                           /**< Length of the payload in flight. */
+static uint32_t                     m_slot_tx_us;                               /**< Time spent transmitting in this timeslot. */
+static uint32_t                     m_slot_ack_us;                              /**< Time spent waiting for acknowledgements in this timeslot. */
+static uint32_t                     m_slot_rx_us;                               /**< Time spent listening in this timeslot. */
+static uint8_t                      m_ext_streak = 0;                           /**< Extensions in a row in this timeslot with a Tx backlog. */
+static uint32_t                     m_slot_ext_requested;                       /**< Extensions requested in this timeslot. */
+static uint32_t                     m_slot_ext_granted;                         /**< Extensions granted in this timeslot. */
+static uint32_t                     m_slot_ext_failed;                          /**< Extensions refused in this timeslot. */
+static bool                         m_ble_aware = false;                        /**< Whether timeslots are placed between BLE connection events. */
+static volatile uint32_t            m_ble_interval_us = 0;                      /**< BLE connection interval, 0 when not connected. */
+static volatile uint32_t            m_ble_anchor;                               /**< Estimated RTC time of a BLE connection event start. */
+static volatile bool                m_ble_anchor_valid = false;                 /**< Whether m_ble_anchor is younger than TS_BLE_ANCHOR_MAX_AGE_US, so its age is not ambiguous after the RTC counter wraps. */
+static volatile bool                m_timeslot_active = false;                  /**< Whether the radio is ours, between slot start and the end-of-slot timeout. */
 void RADIO_IRQHandler(void);
+static void rx_drain(void);
+static void rx_listen_stop(void);
+static void rx_schedule(void);
+static bool configure_next_event_ble(void);
+static bool ble_gap_get(uint32_t anchor, uint32_t interval_us, uint32_t from_us, uint32_t * p_start_us, uint32_t * p_end_us);
 
 
 /** Address. */
@@ -59,361 +277,2300 @@ static const uint8_t base_addr_1[4] = {0xC2, 0xC2, 0xC2, 0xC2};     /**< Base ad
 static const uint8_t addr_prefix[8] = {0xE7, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8 };    /**< Address prefix. */
 
 
-/**@brief Request next timeslot event in earliest configuration.
- * @note  Will call softdevice API.
+/**@brief Converts RTC ticks to microseconds.
  */
-uint32_t request_next_event_earliest(void)
+static uint32_t ticks_to_us(uint32_t ticks)
 {
-    m_timeslot_request.request_type                = NRF_RADIO_REQ_TYPE_EARLIEST;
-    m_timeslot_request.params.earliest.hfclk       = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
-    m_timeslot_request.params.earliest.priority    = NRF_RADIO_PRIORITY_NORMAL;
-    m_timeslot_request.params.earliest.length_us   = TS_LEN_US;
-    m_timeslot_request.params.earliest.timeout_us  = 500000;
-    return sd_radio_request(&m_timeslot_request);
+    return (uint32_t)(((uint64_t)ticks * 1000000UL) / APP_TIMER_CLOCK_FREQ);
 }
 
 
-/**@brief Configure next timeslot event in earliest configuration.
+/**@brief Converts microseconds to RTC ticks, rounding down.
  */
-void configure_next_event_earliest(void)
+static uint32_t us_to_ticks(uint32_t us)
 {
-    m_timeslot_request.request_type                = NRF_RADIO_REQ_TYPE_EARLIEST;
-    m_timeslot_request.params.earliest.hfclk       = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
-    m_timeslot_request.params.earliest.priority    = NRF_RADIO_PRIORITY_NORMAL;
-    m_timeslot_request.params.earliest.length_us   = TS_LEN_US;
-    m_timeslot_request.params.earliest.timeout_us  = 500000;
+    return (uint32_t)(((uint64_t)us * APP_TIMER_CLOCK_FREQ) / 1000000UL);
 }
 
 
-/**@brief Configure next timeslot event in normal configuration.
+/**@brief Number of bytes in all Tx FIFOs.
  */
- /*
-void configure_next_event_normal(void)
+static uint32_t tx_backlog_bytes(void)
 {
-    m_timeslot_request.request_type               = NRF_RADIO_REQ_TYPE_NORMAL;
-    m_timeslot_request.params.normal.hfclk        = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
-    m_timeslot_request.params.normal.priority     = NRF_RADIO_PRIORITY_HIGH;
-    m_timeslot_request.params.normal.length_us    = TS_LEN_US;
-    m_timeslot_request.params.normal.distance_us  = 100000;
-}*/
+    uint32_t bytes = 0;
+
+    for (uint32_t i = 0; i < ESB_TIMESLOT_CLASS_COUNT; i++)
+    {
+        for (uint32_t pipe = 0; pipe < NRF_ESB_PIPE_COUNT; pipe++)
+        {
+            bytes += fifo_num_elem_get(&m_tx_classes[i].p_fifos[pipe]);
+        }
+    }
 
+    return bytes;
+}
 
-/**@brief Timeslot signal handler.
+
+/**@brief Time in RTC ticks the oldest packet in the Tx FIFOs has been queued.
+ *
+ * @note Reads the FIFO heads outside the consumer context, so the result is an estimate if a
+ *       packet is sent meanwhile.
  */
-void nrf_evt_signal_handler(uint32_t evt_id)
+static uint32_t tx_oldest_age_ticks(void)
 {
-    uint32_t err_code;
+    uint32_t       now = app_timer_cnt_get();
+    uint32_t       age = 0;
+    fifo_pkt_hdr_t hdr;
 
-    switch (evt_id)
+    for (uint32_t i = 0; i < ESB_TIMESLOT_CLASS_COUNT; i++)
     {
-        case NRF_EVT_RADIO_SIGNAL_CALLBACK_INVALID_RETURN:
-            // No implementation needed
-            break;
+        for (uint32_t pipe = 0; pipe < NRF_ESB_PIPE_COUNT; pipe++)
+        {
+            if (fifo_peek_hdr(&m_tx_classes[i].p_fifos[pipe], &hdr))
+            {
+                age = MAX(age, app_timer_cnt_diff_compute(now, hdr.time));
+            }
+        }
+    }
 
-        case NRF_EVT_RADIO_SESSION_IDLE:
-            err_code = sd_radio_session_close();
-            APP_ERROR_CHECK(err_code);
-            break;
+    return age;
+}
 
-        case NRF_EVT_RADIO_SESSION_CLOSED:
-            // No implementation needed, session ended
-            break;
 
-        case NRF_EVT_RADIO_BLOCKED:
-            // Fall through
-    
-        case NRF_EVT_RADIO_CANCELED:
-            err_code = request_next_event_earliest();
-            APP_ERROR_CHECK(err_code);
-            break;
+/**@brief Estimates the radio time needed to send everything in the Tx FIFOs.
+ *
+ * @details Packets are assumed to be as long as the ones sent recently, and to take as many
+ *          attempts.
+ */
+static uint32_t tx_backlog_us(void)
+{
+    return CEIL_DIV(tx_backlog_bytes(), m_tx_rec_len_avg) * m_tx_airtime_us;
+}
 
-        default:
-            break;
+
+/**@brief Whether an RTC time has passed.
+ */
+static bool rtc_time_passed(uint32_t time, uint32_t now)
+{
+    return app_timer_cnt_diff_compute(time, now) > (APP_TIMER_MAX_CNT_VAL / 2);
+}
+
+
+/**@brief Time left until the closest deadline of a queued message.
+ *
+ * @param[out] p_remaining_us Time left, 0 if the deadline has passed.
+ *
+ * @return Whether a message with a deadline is queued.
+ *
+ * @note Reads the deadlines outside the contexts updating them, so the result is an estimate if
+ *       a message is queued or delivered meanwhile.
+ */
+static bool tx_deadline_remaining_get(uint32_t * p_remaining_us)
+{
+    uint32_t now       = app_timer_cnt_get();
+    uint32_t min_ticks = APP_TIMER_MAX_CNT_VAL;
+    bool     found     = false;
+
+    for (uint32_t i = 0; i < TX_DEADLINE_MAX; i++)
+    {
+        if (m_tx_deadlines[i].chunks != 0)
+        {
+            uint32_t deadline = m_tx_deadlines[i].deadline;
+
+            found     = true;
+            min_ticks = MIN(min_ticks, rtc_time_passed(deadline, now) ? 0 : app_timer_cnt_diff_compute(deadline, now));
+        }
     }
+
+    *p_remaining_us = ticks_to_us(min_ticks);
+    return found;
 }
 
-NRF_SDH_SOC_OBSERVER(m_esb_evt_observer, 0, nrf_evt_signal_handler, NULL);
-/**@brief Timeslot event handler.
+
+/**@brief Updates the deadline of a message when one of its packets leaves the Tx FIFO.
+ *
+ * @details The deadline is met when the last packet of the message is delivered in time, and
+ *          missed if a packet is dropped, evicted or discarded.
+ *
+ * @param[in] id Identifier of the message, see @ref fifo_pkt_hdr_t.
  */
-nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type)
+static void tx_deadline_update(uint32_t id, bool delivered)
 {
-    //Initialize with default action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE:
-    signal_callback_return_param.params.request.p_next = NULL;
-    signal_callback_return_param.callback_action       = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
-    switch(signal_type)
+    uint32_t now = app_timer_cnt_get();
+
+    CRITICAL_REGION_ENTER();
+    for (uint32_t i = 0; i < TX_DEADLINE_MAX; i++)
     {
-        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_START:
-            /* Start of the timeslot - set up timer interrupt */
-            //nrf_gpio_pin_toggle(28);	
-            NRF_TIMER0->TASKS_STOP          = 1;
-            NRF_TIMER0->TASKS_CLEAR         = 1;
-            NRF_TIMER0->MODE                = (TIMER_MODE_MODE_Timer << TIMER_MODE_MODE_Pos);
-            NRF_TIMER0->EVENTS_COMPARE[0]   = 0;
-            NRF_TIMER0->EVENTS_COMPARE[1]   = 0;
-            NRF_TIMER0->INTENSET            = TIMER_INTENSET_COMPARE0_Msk | TIMER_INTENSET_COMPARE1_Msk ;
-            NRF_TIMER0->CC[0]               = TS_LEN_US - TS_SAFETY_MARGIN_US;
-            NRF_TIMER0->CC[1]               = (TS_LEN_US - TS_EXTEND_MARGIN_US);
-            NRF_TIMER0->BITMODE             = (TIMER_BITMODE_BITMODE_24Bit << TIMER_BITMODE_BITMODE_Pos);
-            NRF_TIMER0->TASKS_START         = 1;
-            // Disable and enable the Radio to reset the RADIO registers, needed from S1xx v8.x
-            NRF_RADIO->POWER            = ((RADIO_POWER_POWER_Disabled << RADIO_POWER_POWER_Pos) & RADIO_POWER_POWER_Msk);
-            NRF_RADIO->POWER            = ((RADIO_POWER_POWER_Enabled  << RADIO_POWER_POWER_Pos) & RADIO_POWER_POWER_Msk);
-            /* Call TIMESLOT_BEGIN_IRQHandler later. */
-            NVIC_EnableIRQ(TIMER0_IRQn); 
-            NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
-            break;
+        tx_deadline_t * p_entry = &m_tx_deadlines[i];
 
-        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_RADIO:
-            RADIO_IRQHandler();
+        if (p_entry->chunks == 0 || p_entry->id != id)
+        {
+            continue;
+        }
+
+        if (delivered && --p_entry->chunks > 0)
+        {
             break;
+        }
+
+        if (delivered && !rtc_time_passed(p_entry->deadline, now))
+        {
+            m_stats.tx[p_entry->tx_class].deadline_met++;
+        }
+        else
+        {
+            m_stats.tx[p_entry->tx_class].deadline_missed++;
+        }
+        p_entry->chunks = 0;
+        break;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**@brief Counts the deadlines that passed before their message was delivered as missed.
+ */
+static void tx_deadline_expire(void)
+{
+    uint32_t now = app_timer_cnt_get();
+
+    CRITICAL_REGION_ENTER();
+    for (uint32_t i = 0; i < TX_DEADLINE_MAX; i++)
+    {
+        tx_deadline_t * p_entry = &m_tx_deadlines[i];
+
+        if (p_entry->chunks != 0 && rtc_time_passed(p_entry->deadline, now))
+        {
+            m_stats.tx[p_entry->tx_class].deadline_missed++;
+            p_entry->chunks = 0;
+        }
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**@brief Picks the priority of the next timeslot request.
+ *
+ * @details Escalates to high priority when the Tx backlog or the age of the oldest queued packet
+ *          reaches its threshold. Drops back to normal priority once both are below half their
+ *          thresholds, so the priority doesn't flip on every request. Requests made while a
+ *          deadline is close are also at high priority.
+ */
+static uint8_t request_priority_get(void)
+{
+    uint32_t depth = tx_backlog_bytes();
+    uint32_t age   = tx_oldest_age_ticks();
+    uint32_t remaining_us;
+
+    if (!m_escalated)
+    {
+        if ((m_escalate_depth != 0 && depth >= m_escalate_depth) ||
+            (m_escalate_age_ticks != 0 && age >= m_escalate_age_ticks))
+        {
+            m_escalated = true;
+            m_stats.slot.escalations++;
+        }
+    }
+    else if ((m_escalate_depth == 0 || depth < (m_escalate_depth / 2)) &&
+             (m_escalate_age_ticks == 0 || age < (m_escalate_age_ticks / 2)))
+    {
+        m_escalated = false;
+    }
+
+    if (!m_escalated && tx_deadline_remaining_get(&remaining_us) && remaining_us < TS_DEADLINE_URGENT_US)
+    {
+        /* A deadline is close: don't wait for BLE activity. */
+        m_stats.slot.deadline_escalations++;
+        return NRF_RADIO_PRIORITY_HIGH;
+    }
+
+    return m_escalated ? NRF_RADIO_PRIORITY_HIGH : NRF_RADIO_PRIORITY_NORMAL;
+}
+
+
+/**@brief Length of the next timeslot: long enough for the Tx backlog, within bounds.
+ */
+static uint32_t timeslot_len_get(void)
+{
+    m_timeslot_len_us = MIN(MAX(tx_backlog_us() + TS_SAFETY_MARGIN_US, TS_LEN_MIN_US), TS_LEN_MAX_US);
+    m_stats.slot.last_request_us = m_timeslot_len_us;
+
+    return m_timeslot_len_us;
+}
+
+
+/**@brief Longest extension that still ends the timeslot in time for the next periodic one, or
+ *        for the next BLE connection event.
+ */
+static uint32_t extension_len_max_get(void)
+{
+    uint32_t used_us = m_timeslot_len_us + m_total_timeslot_length + TS_PERIOD_GUARD_US;
+    uint32_t anchor  = m_ble_anchor;
+    uint32_t now     = app_timer_cnt_get();
+    uint32_t anchor_age_us;
+    uint32_t slot_age_us;
+    uint32_t end_us;
+    uint32_t start_us;
+    uint32_t gap_end_us;
+
+    if (m_period_us == 0 && m_ble_aware && m_ble_anchor_valid)
+    {
+        anchor_age_us = ticks_to_us(app_timer_cnt_diff_compute(now, anchor));
+        slot_age_us   = ticks_to_us(app_timer_cnt_diff_compute(now, m_slot_start_time));
+
+        /* End of the timeslot so far, relative to the connection event anchor. */
+        end_us = (anchor_age_us >= slot_age_us) ? (anchor_age_us - slot_age_us + m_timeslot_len_us + m_total_timeslot_length) : 0;
+
+        if (m_ble_interval_us != 0 && end_us == 0)
+        {
+            /* Anchor taken during this timeslot, its timing can't be trusted. */
+            return 0;
+        }
+
+        if (ble_gap_get(anchor, m_ble_interval_us, end_us, &start_us, &gap_end_us))
+        {
+            return (start_us == end_us) ? MIN(gap_end_us - end_us, TX_LEN_EXTENSION_MAX_US) : 0;
+        }
+    }
+
+    if (m_period_us == 0)
+    {
+        return TX_LEN_EXTENSION_MAX_US;
+    }
+
+    return (m_period_us > used_us) ? MIN(m_period_us - used_us, TX_LEN_EXTENSION_MAX_US) : 0;
+}
+
+
+/**@brief Whether there is a reason to extend the timeslot: data to send, or listening required.
+ */
+static bool extension_needed(void)
+{
+    return (tx_backlog_bytes() > 0) || (m_rx_required && !m_on_demand);
+}
+
+
+/**@brief Length of the next extension: long enough for the Tx backlog, within bounds.
+ *
+ * @details The length doubles with each extension in a row that still finds a Tx backlog, so a
+ *          long backlog needs few extension requests. Listening alone gets the shortest one.
+ */
+static uint32_t extension_len_get(void)
+{
+    uint32_t len_us = TX_LEN_EXTENSION_MIN_US;
+
+    if (tx_backlog_bytes() > 0)
+    {
+        len_us       = MAX(tx_backlog_us(), TX_LEN_EXTENSION_MIN_US << m_ext_streak);
+        m_ext_streak = MIN(m_ext_streak + 1, TX_LEN_EXTENSION_GROWTH_MAX);
+    }
+    else
+    {
+        m_ext_streak = 0;
+    }
+
+    m_extension_len_us = MIN(MIN(len_us, TX_LEN_EXTENSION_MAX_US), extension_len_max_get());
+    m_stats.slot.last_extension_us = m_extension_len_us;
+
+    return m_extension_len_us;
+}
+
+
+/**@brief Whether the oldest queued packet is getting close to the age that escalates requests.
+ */
+static bool tx_queue_urgent(void)
+{
+    return (m_escalate_age_ticks != 0) && (tx_oldest_age_ticks() >= (m_escalate_age_ticks / 2));
+}
+
+
+/**@brief Timeout of the next earliest request.
+ *
+ * @details The more earliest requests are blocked, the longer the timeout, so the SoftDevice
+ *          keeps looking for a timeslot instead of reporting NRF_EVT_RADIO_BLOCKED over and over.
+ *          The timeout is cut short when queued packets would reach the escalation age first, so
+ *          the next request can be made at high priority.
+ */
+static uint32_t earliest_timeout_get(void)
+{
+    uint32_t timeout_us = TS_EARLIEST_TIMEOUT_US +
+                          (uint32_t)(((uint64_t)(TS_EARLIEST_TIMEOUT_MAX_US - TS_EARLIEST_TIMEOUT_US) * m_blocked_permille) / 1000);
+    uint32_t age;
+
+    if (m_escalate_age_ticks != 0 && tx_backlog_bytes() > 0)
+    {
+        age        = tx_oldest_age_ticks();
+        timeout_us = MIN(timeout_us, (age < m_escalate_age_ticks) ? MAX(ticks_to_us(m_escalate_age_ticks - age), TS_EARLIEST_TIMEOUT_MIN_US)
+                                                                  : TS_EARLIEST_TIMEOUT_MIN_US);
+    }
+
+    m_stats.slot.earliest_timeout_us = timeout_us;
+
+    return timeout_us;
+}
+
+
+/**@brief Adds the outcome of an earliest request to the blocked rate.
+ */
+static void blocked_rate_sample(bool blocked)
+{
+    m_blocked_permille             = (m_blocked_permille * 7 + (blocked ? 1000 : 0)) / 8;
+    m_stats.slot.blocked_permille  = m_blocked_permille;
+}
+
+
+/**@brief Notes the time of the first request since the latest timeslot start.
+ */
+static void request_time_mark(void)
+{
+    if (!m_request_pending)
+    {
+        m_request_pending = true;
+        m_request_time    = app_timer_cnt_get();
+    }
+}
+
+
+/**@brief Wait before re-requesting after a blocked or cancelled request, 0 to re-request at once.
+ *
+ * @details A single blocked request is retried at once. After that the wait doubles with each
+ *          blocked request in a row, unless a deadline is queued or queued packets are getting
+ *          old.
+ */
+static uint32_t retry_delay_ms_get(void)
+{
+    uint32_t remaining_us;
+
+    if (m_blocked_streak < 2 || tx_deadline_remaining_get(&remaining_us) || tx_queue_urgent())
+    {
+        return 0;
+    }
+
+    return MIN(TS_RETRY_BACKOFF_MIN_MS << MIN(m_blocked_streak - 2, 4), TS_RETRY_BACKOFF_MAX_MS);
+}
+
+
+/**@brief Delayed re-request.
+ */
+static void retry_timeout_handler(void * p_context)
+{
+    m_retry_due = true;
+    NVIC_SetPendingIRQ(TIMESLOT_WAKE_IRQn);
+}
+
+
+/**@brief Request next timeslot event in earliest configuration.
+ * @note  Will call softdevice API.
+ */
+uint32_t request_next_event_earliest(void)
+{
+    configure_next_event_earliest();
+    request_time_mark();
+    m_stats.slot.requests++;
+    return sd_radio_request(&m_timeslot_request);
+}
+
+
+/**@brief Configure the request for the timeslot after the one that just ended or was lost.
+ *
+ * @details In periodic mode, normal requests are placed a whole number of periods after the
+ *          start of the latest timeslot, so lost timeslots don't shift the phase. Otherwise, when
+ *          BLE connection timing is known, normal requests are placed between connection
+ *          events. Earliest requests are used until a timeslot has started, after too many lost
+ *          timeslots, and when the planned timeslot would start after a queued deadline.
+ */
+static void configure_next_event(void)
+{
+    uint32_t remaining_us;
+    uint32_t wait_us;
+    bool     ble = false;
+
+    if (m_period_us != 0 && m_period_anchored && m_period_misses < TS_PERIOD_MAX_MISSES)
+    {
+        configure_next_event_normal();
+    }
+    else if (m_period_us == 0 && m_ble_aware && m_period_anchored && m_period_misses < TS_PERIOD_MAX_MISSES &&
+             configure_next_event_ble())
+    {
+        /* Placed between BLE connection events. */
+        ble = true;
+    }
+    else
+    {
+        if (m_period_us != 0 && m_period_anchored)
+        {
+            m_stats.slot.period_reanchors++;
+        }
+        m_period_anchored = false;
+        configure_next_event_earliest();
+    }
+
+    if (m_timeslot_request.request_type == NRF_RADIO_REQ_TYPE_NORMAL && tx_deadline_remaining_get(&remaining_us))
+    {
+        wait_us = m_timeslot_request.params.normal.distance_us -
+                  MIN(ticks_to_us(app_timer_cnt_diff_compute(app_timer_cnt_get(), m_slot_start_time)),
+                      m_timeslot_request.params.normal.distance_us);
+        if (wait_us > remaining_us)
+        {
+            /* The planned timeslot is too late for a queued deadline. */
+            m_stats.slot.deadline_overrides++;
+            ble = false;
+            configure_next_event_earliest();
+        }
+    }
+
+    request_time_mark();
+    m_stats.slot.requests++;
+    if (ble)
+    {
+        m_stats.slot.ble_placed_requests++;
+    }
+}
+
+
+/**@brief Adds the time since the previous call to the session time, and updates the share of it
+ *        spent idle.
+ */
+static void session_time_sample(void)
+{
+    uint32_t now = app_timer_cnt_get();
+    uint64_t idle_us;
+
+    if (!m_session_open)
+    {
+        return;
+    }
+
+    m_stats.slot.session_time_us += ticks_to_us(app_timer_cnt_diff_compute(now, m_session_time));
+    m_session_time                = now;
+
+    /* Include the idle period in progress, without counting it twice later. */
+    idle_us = m_stats.slot.idle_time_us;
+    if (m_session_idle)
+    {
+        idle_us += ticks_to_us(app_timer_cnt_diff_compute(now, m_idle_since));
+    }
+
+    m_stats.slot.idle_permille = (m_stats.slot.session_time_us > 0) ?
+                                 (uint32_t)((idle_us * 1000) / m_stats.slot.session_time_us) : 0;
+}
+
+
+/**@brief Whether another timeslot is needed, in on-demand mode.
+ */
+static bool timeslot_needed(void)
+{
+    return (tx_backlog_bytes() > 0) || m_rx_due;
+}
+
+
+/**@brief Requests a timeslot if the session is idle, in on-demand mode, or reopens it if it was lost.
+ *
+ * @note May be called from any interrupt priority.
+ */
+static void timeslot_wake(void)
+{
+    if ((m_on_demand && m_session_idle) || m_session_lost)
+    {
+        /* The SoftDevice can't be called from every priority, so request in a low priority interrupt. */
+        NVIC_SetPendingIRQ(TIMESLOT_WAKE_IRQn);
+    }
+}
+
+
+/**@brief Starts the wait before the next attempt to reopen a lost session.
+ */
+static void recover_backoff_start(void)
+{
+    uint32_t err_code;
+
+    if (m_recover_wait)
+    {
+        return;
+    }
+
+    m_recover_wait = true;
+    err_code = app_timer_start(m_recover_timer, APP_TIMER_TICKS(m_recover_backoff_ms), NULL);
+    APP_ERROR_CHECK(err_code);
+
+    m_recover_backoff_ms = MIN(m_recover_backoff_ms * 2, TS_RECOVER_BACKOFF_MAX_MS);
+}
+
+
+/**@brief Ends the recovery backoff.
+ */
+static void recover_timeout_handler(void * p_context)
+{
+    m_recover_wait = false;
+    timeslot_wake();
+}
+
+
+/**@brief Marks the session as lost, so it is reopened once there is work for it.
+ */
+static void session_lost(void)
+{
+    if (m_session_lost)
+    {
+        return;
+    }
+
+    session_time_sample();
+    m_session_open = false;
+    m_session_idle = false;
+    m_session_lost = true;
+
+    if (!m_outage)
+    {
+        m_outage       = true;
+        m_outage_start = app_timer_cnt_get();
+        m_outage_us    = 0;
+        m_stats.slot.outages++;
+    }
+}
+
+
+/**@brief Reopens a lost session and requests a timeslot, if there is work and the backoff is over.
+ */
+static void session_recover(void)
+{
+    uint32_t err_code;
+
+    if (m_recover_wait || !(tx_backlog_bytes() > 0 || m_rx_required || m_rx_due))
+    {
+        /* Called again by the backoff timer, or when data is queued. */
+        return;
+    }
+
+    m_stats.slot.recover_attempts++;
+    m_period_anchored = false;
+
+    err_code = sd_radio_session_open(radio_callback);
+    if (err_code != NRF_SUCCESS)
+    {
+        recover_backoff_start();
+        return;
+    }
+
+    err_code = request_next_event_earliest();
+    if (err_code != NRF_SUCCESS)
+    {
+        /* NRF_EVT_RADIO_SESSION_CLOSED starts the backoff. */
+        (void)sd_radio_session_close();
+        return;
+    }
+
+    m_session_lost = false;
+    m_session_open = true;
+    m_session_time = app_timer_cnt_get();
+}
+
+
+/**@brief IRQHandler used for execution context management.
+  *       Any available handler can be used as we're not using the associated hardware.
+  *       This handler is used to request a timeslot when the session has gone idle.
+  */
+void TIMESLOT_WAKE_IRQHandler(void)
+{
+    uint32_t err_code;
+
+    if (m_session_lost)
+    {
+        session_recover();
+        return;
+    }
+
+    if (m_retry_due)
+    {
+        /* The timeslot the blocked request was planned around is gone, so make an earliest request. */
+        m_retry_due       = false;
+        m_retry_wait      = false;
+        m_period_anchored = false;
+        err_code = request_next_event_earliest();
+        if (err_code != NRF_SUCCESS)
+        {
+            session_lost();
+            (void)sd_radio_session_close();
+        }
+        return;
+    }
+
+    if (!m_session_idle)
+    {
+        return;
+    }
+
+    m_session_idle = false;
+    m_stats.slot.idle_time_us += ticks_to_us(app_timer_cnt_diff_compute(app_timer_cnt_get(), m_idle_since));
+    m_stats.slot.wakeups++;
+
+    /* The previous timeslot may be long gone, so start over from an earliest request. */
+    m_period_anchored = false;
+    err_code = request_next_event_earliest();
+    if (err_code != NRF_SUCCESS)
+    {
+        /* Reopened by session_recover once NRF_EVT_RADIO_SESSION_CLOSED has started the backoff. */
+        session_lost();
+        (void)sd_radio_session_close();
+    }
+}
+
+
+/**@brief Opens an Rx window in on-demand mode.
+ */
+static void rx_window_timeout_handler(void * p_context)
+{
+    m_rx_due = true;
+    timeslot_wake();
+}
+
+
+/**@brief Adds how the timeslot that is ending was used to the utilization statistics.
+ *
+ * @note UESB is stopped by then, so all Tx and Rx time has been counted.
+ */
+static void util_slot_record(void)
+{
+    esb_timeslot_util_stats_t * p_util  = &m_stats.util;
+    uint32_t                    len_us  = m_timeslot_len_us + m_total_timeslot_length;
+    uint32_t                    used_us = m_slot_tx_us + m_slot_ack_us + m_slot_rx_us;
+
+    p_util->last_slot_len_us     = len_us;
+    p_util->last_slot_tx_us      = m_slot_tx_us;
+    p_util->last_slot_ack_us     = m_slot_ack_us;
+    p_util->last_slot_rx_us      = m_slot_rx_us;
+    p_util->last_slot_idle_us    = (len_us > used_us) ? (len_us - used_us) : 0;
+
+    p_util->granted_time_us     += len_us;
+    p_util->tx_time_us          += m_slot_tx_us;
+    p_util->ack_wait_time_us    += m_slot_ack_us;
+    p_util->rx_time_us          += m_slot_rx_us;
+    p_util->idle_time_us        += p_util->last_slot_idle_us;
+}
+
+
+/**@brief Records the start of a timeslot and how far it was from its planned time.
+ */
+static void slot_start_record(void)
+{
+    uint32_t now = app_timer_cnt_get();
+    uint32_t interval_us;
+    uint32_t jitter_us;
+
+    if (m_timeslot_request.request_type == NRF_RADIO_REQ_TYPE_NORMAL)
+    {
+        interval_us = ticks_to_us(app_timer_cnt_diff_compute(now, m_slot_start_time));
+        jitter_us   = (interval_us > m_timeslot_request.params.normal.distance_us) ?
+                      (interval_us - m_timeslot_request.params.normal.distance_us) :
+                      (m_timeslot_request.params.normal.distance_us - interval_us);
+
+        m_stats.slot.periodic_slots++;
+        m_stats.slot.period_jitter_last_us = jitter_us;
+        m_stats.slot.period_jitter_max_us  = MAX(m_stats.slot.period_jitter_max_us, jitter_us);
+    }
+
+    m_slot_escalated = (m_timeslot_request.request_type == NRF_RADIO_REQ_TYPE_NORMAL) ?
+                       (m_timeslot_request.params.normal.priority == NRF_RADIO_PRIORITY_HIGH) :
+                       (m_timeslot_request.params.earliest.priority == NRF_RADIO_PRIORITY_HIGH);
+    if (m_slot_escalated)
+    {
+        m_stats.slot.escalated_slots++;
+    }
+
+    m_stats.util.granted_slots++;
+
+    if (m_timeslot_request.request_type == NRF_RADIO_REQ_TYPE_EARLIEST)
+    {
+        blocked_rate_sample(false);
+
+        if (m_request_pending)
+        {
+            uint32_t delay_us = ticks_to_us(app_timer_cnt_diff_compute(now, m_request_time));
+            uint32_t bucket   = 0;
+
+            while (bucket < (ESB_TIMESLOT_START_HIST_LEN - 1) && (delay_us / 1000) >= (1UL << bucket))
+            {
+                bucket++;
+            }
+            m_stats.slot.start_delay_hist[bucket]++;
+            m_stats.slot.start_delay_max_us = MAX(m_stats.slot.start_delay_max_us, delay_us);
+        }
+    }
+    m_request_pending = false;
+    m_blocked_streak  = 0;
+    m_first_tx_pending = true;
+
+    if (m_renew_gap)
+    {
+        uint32_t gap_us = ticks_to_us(app_timer_cnt_diff_compute(now, m_renew_end_time));
+
+        m_stats.slot.renew_gap_last_us = gap_us;
+        m_stats.slot.renew_gap_max_us  = MAX(m_stats.slot.renew_gap_max_us, gap_us);
+        m_renew_gap                    = false;
+    }
+
+    if (m_outage)
+    {
+        uint32_t outage_us = m_outage_us + ticks_to_us(app_timer_cnt_diff_compute(now, m_outage_start));
+
+        m_stats.slot.outage_last_us   = outage_us;
+        m_stats.slot.outage_max_us    = MAX(m_stats.slot.outage_max_us, outage_us);
+        m_stats.slot.outage_total_us += outage_us;
+        m_outage                      = false;
+        m_recover_backoff_ms          = TS_RECOVER_BACKOFF_MIN_MS;
+    }
+
+    m_slot_start_time = now;
+    m_period_anchored = true;
+    m_period_misses   = 0;
+    m_rx_due          = false;
+
+    m_ext_streak         = 0;
+    m_slot_tx_us         = 0;
+    m_slot_ack_us        = 0;
+    m_slot_rx_us         = 0;
+    m_slot_ext_requested = 0;
+    m_slot_ext_granted   = 0;
+    m_slot_ext_failed    = 0;
+}
+
+
+/**@brief Configure next timeslot event in earliest configuration.
+ */
+void configure_next_event_earliest(void)
+{
+    uint32_t remaining_us;
+
+    m_timeslot_request.request_type                = NRF_RADIO_REQ_TYPE_EARLIEST;
+    m_timeslot_request.params.earliest.hfclk       = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+    m_timeslot_request.params.earliest.priority    = request_priority_get();
+    m_timeslot_request.params.earliest.length_us   = timeslot_len_get();
+    m_timeslot_request.params.earliest.timeout_us  = earliest_timeout_get();
+
+    /* Give up early enough to retry at high priority before a queued deadline. */
+    if (tx_deadline_remaining_get(&remaining_us))
+    {
+        m_timeslot_request.params.earliest.timeout_us = MAX(MIN(remaining_us, m_timeslot_request.params.earliest.timeout_us), TS_DEADLINE_TIMEOUT_MIN_US);
+    }
+}
+
+
+/**@brief Configure next timeslot event in normal configuration.
+ *
+ * @details The distance counts from the start of the latest timeslot, skipping the periods of
+ *          timeslots that were lost since.
+ */
+void configure_next_event_normal(void)
+{
+    m_timeslot_request.request_type               = NRF_RADIO_REQ_TYPE_NORMAL;
+    m_timeslot_request.params.normal.hfclk        = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+    m_timeslot_request.params.normal.priority     = request_priority_get();
+    m_timeslot_request.params.normal.length_us    = MIN(timeslot_len_get(), m_period_us - TS_PERIOD_GUARD_US);
+    m_timeslot_request.params.normal.distance_us  = m_period_us * (m_period_misses + 1);
+    m_timeslot_len_us                             = m_timeslot_request.params.normal.length_us;
+}
+
+
+/**@brief Finds the gap between BLE connection events at or after a given time.
+ *
+ * @details The anchor is estimated from when BLE events are handled, so a connection event is
+ *          assumed to take up to twice the GAP event length after it. Margins grow as the
+ *          anchor ages, since the sleep clocks of the peers drift apart. An idle link has no
+ *          such events, so its anchor is only used until it is TS_BLE_ANCHOR_MAX_AGE_US old.
+ *
+ * @param[in]  anchor      Estimated RTC time of a connection event start.
+ * @param[in]  interval_us Connection interval.
+ * @param[in]  from_us     Earliest start of a timeslot, relative to the anchor.
+ * @param[out] p_start_us  Start of the gap, relative to the anchor. from_us if it is inside a gap.
+ * @param[out] p_end_us    End of the gap, relative to the anchor.
+ *
+ * @return Whether the connection timing is known well enough to place timeslots.
+ */
+static bool ble_gap_get(uint32_t anchor, uint32_t interval_us, uint32_t from_us, uint32_t * p_start_us, uint32_t * p_end_us)
+{
+    uint32_t age_us;
+    uint32_t margin_us;
+    uint32_t busy_us;
+    uint32_t base_us;
+    uint32_t phase_us;
+
+    if (interval_us == 0 || !m_ble_anchor_valid)
+    {
+        return false;
+    }
+
+    age_us = ticks_to_us(app_timer_cnt_diff_compute(app_timer_cnt_get(), anchor));
+    if (age_us > TS_BLE_ANCHOR_MAX_AGE_US)
+    {
+        return false;
+    }
+
+    margin_us = TS_PERIOD_GUARD_US + (uint32_t)(((uint64_t)age_us * TS_BLE_DRIFT_PPM) / 1000000UL);
+    busy_us   = 2 * TS_BLE_EVENT_LEN_US + margin_us;
+    if (interval_us < busy_us + margin_us + TS_LEN_MIN_US)
+    {
+        return false;
+    }
+
+    phase_us = from_us % interval_us;
+    base_us  = from_us - phase_us;
+
+    if (phase_us < busy_us)
+    {
+        *p_start_us = base_us + busy_us;
+    }
+    else if (phase_us + TS_LEN_MIN_US <= interval_us - margin_us)
+    {
+        *p_start_us = from_us;
+    }
+    else
+    {
+        base_us    += interval_us;
+        *p_start_us = base_us + busy_us;
+    }
+    *p_end_us = base_us + interval_us - margin_us;
+
+    return true;
+}
+
+
+/**@brief Configure next timeslot event in normal configuration, between BLE connection events.
+ *
+ * @return Whether the connection timing is known well enough to place the timeslot.
+ */
+static bool configure_next_event_ble(void)
+{
+    uint32_t anchor = m_ble_anchor;
+    uint32_t now    = app_timer_cnt_get();
+    uint32_t now_us = ticks_to_us(app_timer_cnt_diff_compute(now, anchor));
+    uint32_t start_us;
+    uint32_t end_us;
+
+    if (!ble_gap_get(anchor, m_ble_interval_us, now_us + TS_BLE_REQUEST_LEAD_US, &start_us, &end_us))
+    {
+        return false;
+    }
+
+    m_timeslot_request.request_type               = NRF_RADIO_REQ_TYPE_NORMAL;
+    m_timeslot_request.params.normal.hfclk        = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+    m_timeslot_request.params.normal.priority     = request_priority_get();
+    m_timeslot_request.params.normal.length_us    = MIN(timeslot_len_get(), end_us - start_us);
+    m_timeslot_request.params.normal.distance_us  = (start_us - now_us) + ticks_to_us(app_timer_cnt_diff_compute(now, m_slot_start_time));
+    m_timeslot_len_us                             = m_timeslot_request.params.normal.length_us;
+
+    return true;
+}
+
+
+/**@brief Timeslot signal handler.
+ */
+void nrf_evt_signal_handler(uint32_t evt_id)
+{
+    uint32_t err_code;
+    uint32_t retry_delay_ms;
+
+    switch (evt_id)
+    {
+        case NRF_EVT_RADIO_SIGNAL_CALLBACK_INVALID_RETURN:
+            // No implementation needed
+            break;
+
+        case NRF_EVT_RADIO_SESSION_IDLE:
+            if (!m_on_demand && !m_retry_wait)
+            {
+                /* No more timeslots requested. Close the session, it is reopened once there is
+                 * work for it. */
+                session_lost();
+                err_code = sd_radio_session_close();
+                APP_ERROR_CHECK(err_code);
+            }
+            break;
+
+        case NRF_EVT_RADIO_SESSION_CLOSED:
+            if (m_session_lost)
+            {
+                recover_backoff_start();
+            }
+            break;
+
+        case NRF_EVT_RADIO_BLOCKED:
+            m_stats.slot.blocked_cnt++;
+            if (m_timeslot_request.request_type == NRF_RADIO_REQ_TYPE_EARLIEST)
+            {
+                blocked_rate_sample(true);
+            }
+            // Fall through
+    
+        case NRF_EVT_RADIO_CANCELED:
+            if (evt_id == NRF_EVT_RADIO_CANCELED)
+            {
+                m_stats.slot.canceled_cnt++;
+            }
+            m_period_misses++;
+            m_blocked_streak++;
+
+            retry_delay_ms = retry_delay_ms_get();
+            if (retry_delay_ms != 0)
+            {
+                /* Requests keep getting blocked: pace them. Re-requested in TIMESLOT_WAKE_IRQHandler. */
+                m_retry_wait = true;
+                m_stats.slot.retry_delays++;
+                err_code = app_timer_start(m_retry_timer, APP_TIMER_TICKS(retry_delay_ms), NULL);
+                if (err_code == NRF_SUCCESS)
+                {
+                    break;
+                }
+                m_retry_wait = false;
+            }
+
+            configure_next_event();
+            err_code = sd_radio_request(&m_timeslot_request);
+            if (err_code != NRF_SUCCESS)
+            {
+                /* Without a request the session would stall. Start over. */
+                session_lost();
+                (void)sd_radio_session_close();
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+NRF_SDH_SOC_OBSERVER(m_esb_evt_observer, 0, nrf_evt_signal_handler, NULL);
+
+
+/**@brief Takes the current time as the end of a BLE connection event.
+ */
+static void ble_anchor_update(void)
+{
+    m_ble_anchor       = (app_timer_cnt_get() - us_to_ticks(TS_BLE_EVENT_LEN_US)) & APP_TIMER_MAX_CNT_VAL;
+    m_ble_anchor_valid = true;
+}
+
+
+/**@brief BLE event handler, learns the connection interval and when connection events happen.
+ *
+ * @details Events caused by packets from the peer are handled right after the connection event
+ *          they were received in.
+ */
+static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
+{
+    switch (p_ble_evt->header.evt_id)
+    {
+        case BLE_GAP_EVT_CONNECTED:
+            ble_anchor_update();
+            m_ble_interval_us = p_ble_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval * UNIT_1_25_MS;
+            break;
+
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+            ble_anchor_update();
+            m_ble_interval_us = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval * UNIT_1_25_MS;
+            break;
+
+        case BLE_GAP_EVT_DISCONNECTED:
+            m_ble_interval_us  = 0;
+            m_ble_anchor_valid = false;
+            break;
+
+        case BLE_GATTS_EVT_WRITE:
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+            ble_anchor_update();
+            break;
+
+        default:
+            break;
+    }
+}
+
+NRF_SDH_BLE_OBSERVER(m_esb_ble_observer, 0, ble_evt_handler, NULL);
+/**@brief Timeslot event handler.
+ */
+nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type)
+{
+    //Initialize with default action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE:
+    signal_callback_return_param.params.request.p_next = NULL;
+    signal_callback_return_param.callback_action       = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
+    switch(signal_type)
+    {
+        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_START:
+            /* Start of the timeslot - set up timer interrupt */
+            //nrf_gpio_pin_toggle(28);	
+            NRF_TIMER0->TASKS_STOP          = 1;
+            NRF_TIMER0->TASKS_CLEAR         = 1;
+            NRF_TIMER0->MODE                = (TIMER_MODE_MODE_Timer << TIMER_MODE_MODE_Pos);
+            NRF_TIMER0->EVENTS_COMPARE[0]   = 0;
+            NRF_TIMER0->EVENTS_COMPARE[1]   = 0;
+            NRF_TIMER0->EVENTS_COMPARE[2]   = 0;
+            NRF_TIMER0->INTENCLR            = TIMER_INTENSET_COMPARE2_Msk;
+            NRF_TIMER0->INTENSET            = TIMER_INTENSET_COMPARE0_Msk | TIMER_INTENSET_COMPARE1_Msk ;
+            NRF_TIMER0->CC[0]               = m_timeslot_len_us - TS_SAFETY_MARGIN_US;
+            NRF_TIMER0->CC[1]               = (m_timeslot_len_us - TS_EXTEND_MARGIN_US);
+            NRF_TIMER0->BITMODE             = (TIMER_BITMODE_BITMODE_24Bit << TIMER_BITMODE_BITMODE_Pos);
+            NRF_TIMER0->TASKS_START         = 1;
+            // Disable and enable the Radio to reset the RADIO registers, needed from S1xx v8.x
+            NRF_RADIO->POWER            = ((RADIO_POWER_POWER_Disabled << RADIO_POWER_POWER_Pos) & RADIO_POWER_POWER_Msk);
+            NRF_RADIO->POWER            = ((RADIO_POWER_POWER_Enabled  << RADIO_POWER_POWER_Pos) & RADIO_POWER_POWER_Msk);
+            /* Call TIMESLOT_BEGIN_IRQHandler later. */
+            NVIC_EnableIRQ(TIMER0_IRQn); 
+            slot_start_record();
+            m_total_timeslot_length = 0;
+            m_timeslot_active = true;
+            NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
+            break;
+
+        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_RADIO:
+            RADIO_IRQHandler();
+            break;
+
+        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_TIMER0:
+            if (NRF_TIMER0->EVENTS_COMPARE[0] &&
+                (NRF_TIMER0->INTENSET & (TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENCLR_COMPARE0_Pos)))
+            {
+                NRF_TIMER0->TASKS_STOP        = 1;
+                NRF_TIMER0->EVENTS_COMPARE[0] = 0;
+                /* Workaround for issue that Softdevice doesn't reinitialize CC[1]&CC[2]*/
+                NRF_TIMER0->INTENCLR =TIMER_INTENSET_COMPARE2_Msk|TIMER_INTENSET_COMPARE1_Msk;
+                NRF_TIMER0->CC[1]=0;
+                NRF_TIMER0->CC[2]=0;
+                /* This is the "timeslot is about to end" timeout. */
+                m_timeslot_active = false;
+                if (m_renew)
+                {
+                    m_renew          = false;
+                    m_renew_gap      = true;
+                    m_renew_end_time = app_timer_cnt_get();
+                    m_stats.slot.renewals++;
+                }
+                if (m_slot_escalated)
+                {
+                    m_stats.slot.escalated_time_us += m_timeslot_len_us + m_total_timeslot_length;
+                }
+                if (!nrf_esb_is_idle())
+                {
+                    NRF_RADIO->INTENCLR      = 0xFFFFFFFF;
+                    NRF_RADIO->TASKS_DISABLE = 1;
+                }
+                if (nrf_atomic_u32_fetch_store(&m_end_deferred, 0) != 0)
+                {
+                    /* The packet in flight did not finish in time. The radio is stopped above,
+                     * also stop what UESB wired to it while the radio is still ours. Its state
+                     * may be in use by rx_drain, so UESB itself is disabled at the timeslot
+                     * handler priority. The packet stays queued and is sent again. */
+                    NRF_PPI->CHENCLR             = (1UL << NRF_ESB_PPI_TIMER_START) | (1UL << NRF_ESB_PPI_TIMER_STOP) |
+                                                   (1UL << NRF_ESB_PPI_RX_TIMEOUT) | (1UL << NRF_ESB_PPI_TX_START);
+                    NRF_ESB_SYS_TIMER->TASKS_STOP = 1;
+                    m_esb_parked                 = false;
+                    m_esb_cut                    = true;
+                    m_stats.slot.tx_end_cuts++;
+                    NVIC_SetPendingIRQ(TIMESLOT_END_IRQn);
+                }
+		//nrf_gpio_pin_toggle(29);	
+                m_stats.slot.active_time_us += m_timeslot_len_us + m_total_timeslot_length;
+                m_stats.slot.last_slot_ext_requested = m_slot_ext_requested;
+                m_stats.slot.last_slot_ext_granted   = m_slot_ext_granted;
+                m_stats.slot.last_slot_ext_failed    = m_slot_ext_failed;
+                m_stats.slot.max_slot_ext_granted    = MAX(m_stats.slot.max_slot_ext_granted, m_slot_ext_granted);
+                util_slot_record();
+
+                if (m_on_demand && !timeslot_needed())
+                {
+                    /* Nothing to do: let the session go idle until TIMESLOT_WAKE_IRQHandler. */
+                    m_session_idle = true;
+                    m_idle_since   = app_timer_cnt_get();
+                    signal_callback_return_param.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_END;
+                }
+                else
+                {
+                    /* Schedule next timeslot. */
+                    configure_next_event();
+                    signal_callback_return_param.params.request.p_next = &m_timeslot_request;
+                    signal_callback_return_param.callback_action       = NRF_RADIO_SIGNAL_CALLBACK_ACTION_REQUEST_AND_END;
+                }
+            }
+
+            if (NRF_TIMER0->EVENTS_COMPARE[1] &&
+                (NRF_TIMER0->INTENSET & (TIMER_INTENSET_COMPARE1_Enabled << TIMER_INTENCLR_COMPARE1_Pos)))
+            {
+                //nrf_gpio_pin_toggle(30);	
+                NRF_TIMER0->EVENTS_COMPARE[1] = 0;
+
+                /* This is the "Time to extend timeslot" timeout. */
+                if (m_total_timeslot_length < (TS_LEN_TOTAL_MAX_US - TX_LEN_EXTENSION_MAX_US) &&
+                    extension_len_max_get() >= TX_LEN_EXTENSION_MIN_US &&
+                    extension_needed())
+                {
+                    if (m_total_timeslot_length >= TS_RENEW_THRESHOLD_US)
+                    {
+                        /* Close to the 128 second limit: this extension leaves time to finish
+                         * the packet in flight before renewing the timeslot. */
+                        m_renew = true;
+                    }
+
+                    /* Request timeslot extension if total length does not exceed 128 seconds,
+                     * or in periodic mode the start of the next timeslot, and there is data to
+                     * send or listening is required. */
+                    m_slot_ext_requested++;
+                    m_stats.slot.ext_requested++;
+                    signal_callback_return_param.params.extend.length_us = extension_len_get();
+                    signal_callback_return_param.callback_action         = NRF_RADIO_SIGNAL_CALLBACK_ACTION_EXTEND;
+                }
+                else
+                {
+                    /* No extension: the timeslot ends at CC[0], disable UESB in a lower
+                     * interrupt priority while the radio is still ours. */
+                    NVIC_SetPendingIRQ(TIMESLOT_END_IRQn);
+                }
+            }
+
+            if (NRF_TIMER0->EVENTS_COMPARE[2] &&
+                (NRF_TIMER0->INTENSET & (TIMER_INTENSET_COMPARE2_Enabled << TIMER_INTENCLR_COMPARE2_Pos)))
+            {
+                /* Rx window edge: start or stop listening in TIMESLOT_BEGIN_IRQHandler. */
+                NRF_TIMER0->EVENTS_COMPARE[2] = 0;
+                NRF_TIMER0->INTENCLR          = TIMER_INTENSET_COMPARE2_Msk;
+                NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
+            }
+            break;
+
+        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_EXTEND_SUCCEEDED:
+            //nrf_gpio_pin_toggle(31);	
+            NRF_TIMER0->TASKS_STOP          = 1;
+            NRF_TIMER0->EVENTS_COMPARE[0]   = 0;
+            NRF_TIMER0->EVENTS_COMPARE[1]   = 0;
+            NRF_TIMER0->CC[0]              += (m_extension_len_us - 25);
+            NRF_TIMER0->CC[1]              += (m_extension_len_us - 25);
+            NRF_TIMER0->TASKS_START         = 1;
+
+            m_total_timeslot_length += m_extension_len_us;
+            m_slot_ext_granted++;
+            m_stats.slot.ext_granted++;
+            NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
+        
+            break;
+
+        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_EXTEND_FAILED:
+            m_stats.slot.extend_failed_cnt++;
+            m_slot_ext_failed++;
+            /* Tried scheduling a new timeslot, but failed. */
+            /* Disabling UESB is done in a lower interrupt priority. */
+            /* Call TIMESLOT_END_IRQHandler later. */
+            NVIC_SetPendingIRQ(TIMESLOT_END_IRQn);
+            //nrf_gpio_pin_toggle(29);	
+            break;
+
+        default:
+            /* No implementation needed. */
+            break;
+    }
+    //default return action is NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE
+    return (&signal_callback_return_param);
+}
+
+
+uint32_t esb_timeslot_periodic_set(uint32_t period_us)
+{
+    if (period_us != 0 &&
+        (period_us < (TS_LEN_MIN_US + TS_PERIOD_GUARD_US) || period_us > (NRF_RADIO_DISTANCE_MAX_US / (TS_PERIOD_MAX_MISSES + 1))))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    m_period_us = period_us;
+
+    return NRF_SUCCESS;
+}
+
+
+uint32_t esb_timeslot_escalation_set(uint32_t depth_bytes, uint32_t age_ms)
+{
+    m_escalate_depth     = depth_bytes;
+    m_escalate_age_ticks = APP_TIMER_TICKS(age_ms);
+
+    return NRF_SUCCESS;
+}
+
+
+uint32_t esb_timeslot_sd_start(void)
+{
+    uint32_t err_code;
+
+    m_period_anchored = false;
+    m_session_idle    = false;
+
+    err_code = sd_radio_session_open(radio_callback);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    m_session_open = true;
+    m_session_time = app_timer_cnt_get();
+
+    err_code = request_next_event_earliest();
+    if (err_code != NRF_SUCCESS)
+    {
+        (void)sd_radio_session_close();
+        m_session_open = false;
+        return err_code;
+    }
+
+    return NRF_SUCCESS;
+}
+
+
+
+uint32_t esb_timeslot_sd_stop(void)
+{
+    session_time_sample();
+    m_session_open = false;
+    m_session_idle = false;
+    m_session_lost = false;
+    m_recover_wait = false;
+    m_outage       = false;
+    m_retry_wait   = false;
+    m_retry_due    = false;
+    (void)app_timer_stop(m_recover_timer);
+    (void)app_timer_stop(m_retry_timer);
+    return sd_radio_session_close();
+}
+
+
+void esb_timeslot_rx_required_set(bool required)
+{
+    m_rx_required = required;
+}
+
+
+void esb_timeslot_ble_aware_set(bool enable)
+{
+    m_ble_aware = enable;
+}
+
+
+uint32_t esb_timeslot_rx_schedule_set(uint32_t window_us, uint32_t period_us, bool sync)
+{
+    if (period_us != 0 &&
+        (window_us < RX_WINDOW_MIN_US || window_us >= period_us || period_us > RX_PERIOD_MAX_US))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    CRITICAL_REGION_ENTER();
+    m_rx_window_us    = window_us;
+    m_rx_period_us    = period_us;
+    m_rx_window_ticks = us_to_ticks(window_us);
+    m_rx_period_ticks = us_to_ticks(period_us);
+    m_rx_sync         = sync;
+    m_rx_sync_pending = false;
+    m_rx_anchor       = app_timer_cnt_get();
+
+    /* Measure the new configuration from scratch. */
+    m_stats.rx.listen_time_us = 0;
+    m_stats.rx.windows        = 0;
+    m_rx_cfg_pkts             = m_stats.rx.drained_pkts;
+    CRITICAL_REGION_EXIT();
+
+    /* Apply it now rather than at the next Tx event. */
+    NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
+
+    return NRF_SUCCESS;
+}
+
+
+uint32_t esb_timeslot_on_demand_set(bool enable, uint32_t rx_interval_ms)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_stop(m_rx_window_timer);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    m_on_demand = enable;
+
+    if (enable && rx_interval_ms != 0)
+    {
+        return app_timer_start(m_rx_window_timer, APP_TIMER_TICKS(rx_interval_ms), NULL);
+    }
+
+    /* Leaving on-demand mode: an idle session has to be woken one last time. */
+    if (!enable && m_session_idle)
+    {
+        NVIC_SetPendingIRQ(TIMESLOT_WAKE_IRQn);
+    }
+
+    return NRF_SUCCESS;
+}
+
+
+/**@brief Adds the time since the previous sample to the Tx FIFO depth averages.
+ *
+ * @note Only called at TIMESLOT_BEGIN_IRQPriority level, or with it masked.
+ */
+static void tx_depth_sample(void)
+{
+    uint32_t     now = app_timer_cnt_get();
+    uint32_t     elapsed;
+    tx_class_t * p_class;
+
+    for (uint32_t i = 0; i < ESB_TIMESLOT_CLASS_COUNT; i++)
+    {
+        p_class = &m_tx_classes[i];
+        elapsed = app_timer_cnt_diff_compute(now, p_class->depth_time);
+
+        p_class->depth_area  += (uint64_t)p_class->depth * elapsed;
+        p_class->depth_ticks += elapsed;
+        p_class->depth        = 0;
+        p_class->depth_time   = now;
+
+        for (uint32_t pipe = 0; pipe < NRF_ESB_PIPE_COUNT; pipe++)
+        {
+            p_class->depth += fifo_num_elem_get(&p_class->p_fifos[pipe]);
+        }
+    }
+}
+
+
+/**@brief Records the time a packet waited in its Tx FIFO before its first transmit attempt.
+ */
+static void tx_delay_record(esb_timeslot_class_t tx_class, uint32_t queued_time)
+{
+    uint32_t delay_us = ticks_to_us(app_timer_cnt_diff_compute(app_timer_cnt_get(), queued_time));
+
+    m_tx_classes[tx_class].delay_sum_us += delay_us;
+    m_tx_classes[tx_class].delay_cnt++;
+
+    m_stats.tx[tx_class].delay_last_us = delay_us;
+    m_stats.tx[tx_class].delay_max_us  = MAX(m_stats.tx[tx_class].delay_max_us, delay_us);
+}
+
+
+/**@brief Finds the oldest packet of the first pipe with data, going round-robin from rr_pipe.
+ *
+ * @return Whether any pipe of the class has data.
+ */
+static bool tx_pipe_peek(tx_class_t * p_class, fifo_pkt_view_t * p_view)
+{
+    for (uint32_t i = 0; i < NRF_ESB_PIPE_COUNT; i++)
+    {
+        if (fifo_peek_view(&p_class->p_fifos[(p_class->rr_pipe + i) % NRF_ESB_PIPE_COUNT], p_view))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**@brief Picks the next packet to transmit.
+ *
+ * @details ESB_TIMESLOT_CLASS_CONTROL has strict priority. The other classes share what is left
+ *          by deficit round robin, in proportion to their weights. Every transmit attempt is
+ *          charged its payload length. Within a class the pipes take turns, so a peer that
+ *          doesn't acknowledge only delays its own packets.
+ *
+ * @param[out] p_view  Oldest packet of the chosen class.
+ *
+ * @return The chosen class, or ESB_TIMESLOT_CLASS_COUNT if all Tx FIFOs are empty.
+ */
+static esb_timeslot_class_t tx_class_select(fifo_pkt_view_t * p_view)
+{
+    tx_class_t * p_class;
+
+    if (tx_pipe_peek(&m_tx_classes[ESB_TIMESLOT_CLASS_CONTROL], p_view))
+    {
+        return ESB_TIMESLOT_CLASS_CONTROL;
+    }
+
+    /* A quantum always covers a full payload, so each class needs at most two visits. */
+    for (uint32_t i = 0; i < 2 * (ESB_TIMESLOT_CLASS_COUNT - 1); i++)
+    {
+        p_class = &m_tx_classes[m_drr_class];
+
+        if (!tx_pipe_peek(p_class, p_view))
+        {
+            /* Idle classes don't save up credit. */
+            p_class->deficit = 0;
+        }
+        else if (p_class->deficit >= p_view->hdr.length)
+        {
+            p_class->deficit -= p_view->hdr.length;
+            return m_drr_class;
+        }
+
+        m_drr_class = (m_drr_class == ESB_TIMESLOT_CLASS_BULK) ? ESB_TIMESLOT_CLASS_TELEMETRY
+                                                                : (esb_timeslot_class_t)(m_drr_class + 1);
+        m_tx_classes[m_drr_class].deficit += m_tx_classes[m_drr_class].weight * NRF_ESB_MAX_PAYLOAD_LENGTH;
+    }
+
+    return ESB_TIMESLOT_CLASS_COUNT;
+}
+
+
+/**@brief Samples the intervals that are otherwise only sampled when the state changes.
+ *
+ * @details Time stamps are taken from the 24-bit RTC counter, which wraps every 1024 seconds.
+ *          Intervals are therefore moved forward at least once a minute, so none of them is
+ *          measured across more than one wrap. The BLE anchor is dropped once it is too old,
+ *          long before a wrap could make it look recent again.
+ */
+static void time_sample_timeout_handler(void * p_context)
+{
+    uint32_t now;
+
+    UNUSED_PARAMETER(p_context);
+
+    CRITICAL_REGION_ENTER();
+    tx_depth_sample();
+    session_time_sample();
+
+    now = app_timer_cnt_get();
+    if (m_session_idle)
+    {
+        m_stats.slot.idle_time_us += ticks_to_us(app_timer_cnt_diff_compute(now, m_idle_since));
+        m_idle_since               = now;
+    }
+    if (m_outage)
+    {
+        m_outage_us   += ticks_to_us(app_timer_cnt_diff_compute(now, m_outage_start));
+        m_outage_start = now;
+    }
+    if (m_ble_anchor_valid && ticks_to_us(app_timer_cnt_diff_compute(now, m_ble_anchor)) > TS_BLE_ANCHOR_MAX_AGE_US)
+    {
+        m_ble_anchor_valid = false;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**@brief Starts reception, if not already receiving.
+ */
+static void rx_listen_start(void)
+{
+    uint32_t err_code;
+
+    if (m_state != STATE_RX)
+    {
+        err_code = nrf_esb_start_rx();
+        APP_ERROR_CHECK(err_code);
+        m_state             = STATE_RX;
+        m_rx_listen_start   = app_timer_cnt_get();
+        m_stats.rx.windows += 1;
+    }
+}
+
+
+/**@brief Stops reception, if receiving, and counts the time spent listening.
+ */
+static void rx_listen_stop(void)
+{
+    if (m_state == STATE_RX)
+    {
+        (void)nrf_esb_stop_rx();
+        m_state = STATE_READY;
+        uint32_t listen_us = ticks_to_us(app_timer_cnt_diff_compute(app_timer_cnt_get(), m_rx_listen_start));
+
+        m_stats.rx.listen_time_us += listen_us;
+        m_slot_rx_us              += listen_us;
+    }
+}
+
+
+/**@brief Finds out whether an Rx window is open.
+ *
+ * @param[out] p_wait_us Time until the window closes if it is open, or until the next one opens.
+ *
+ * @return Whether an Rx window is open.
+ */
+static bool rx_window_get(uint32_t * p_wait_us)
+{
+    uint32_t now = app_timer_cnt_get();
+    uint32_t offset;
+
+    if (m_rx_sync_pending)
+    {
+        /* Center the window on the latest received packet. */
+        m_rx_anchor       = (m_rx_sync_time - m_rx_window_ticks / 2) & APP_TIMER_MAX_CNT_VAL;
+        m_rx_sync_pending = false;
+    }
+
+    /* Keep the anchor within a period, the RTC difference only covers 24 bits. */
+    offset = app_timer_cnt_diff_compute(now, m_rx_anchor);
+    if (offset >= m_rx_period_ticks)
+    {
+        m_rx_anchor = (m_rx_anchor + offset - (offset % m_rx_period_ticks)) & APP_TIMER_MAX_CNT_VAL;
+        offset      = offset % m_rx_period_ticks;
+    }
+
+    if (offset < m_rx_window_ticks)
+    {
+        *p_wait_us = ticks_to_us(m_rx_window_ticks - offset);
+        return true;
+    }
+
+    *p_wait_us = ticks_to_us(m_rx_period_ticks - offset);
+    return false;
+}
+
+
+/**@brief Starts or stops reception following the Rx schedule, when there is nothing to send.
+ *
+ * @details Without an Rx schedule, reception runs for the rest of the timeslot. Otherwise TIMER0
+ *          CC[2] calls TIMESLOT_BEGIN_IRQHandler again at the next window edge.
+ */
+static void rx_schedule(void)
+{
+    uint32_t wait_us;
+
+    if (m_rx_period_us == 0)
+    {
+        rx_listen_start();
+        return;
+    }
+
+    if (rx_window_get(&wait_us))
+    {
+        rx_listen_start();
+    }
+    else
+    {
+        rx_listen_stop();
+    }
+
+    NRF_TIMER0->TASKS_CAPTURE[2] = 1;
+    NRF_TIMER0->CC[2]            = (NRF_TIMER0->CC[2] + wait_us) & 0xFFFFFF;
+    NRF_TIMER0->EVENTS_COMPARE[2] = 0;
+    NRF_TIMER0->INTENSET          = TIMER_INTENSET_COMPARE2_Msk;
+}
+
+
+/**@brief IRQHandler used for execution context management. 
+  *       Any available handler can be used as we're not using the associated hardware.
+  *       This handler is used to stop and disable UESB.
+  */
+void TIMESLOT_END_IRQHandler(void)
+{
+    uint32_t err_code;
+
+       /* Timeslot is about to end: stop UESB, and don't let TIMESLOT_BEGIN_IRQHandler restart it. */
+    m_timeslot_active = false;
+
+    if (m_esb_cut)
+    {
+        /* Stopped by radio_callback with a packet in flight. The timeslot is over, so UESB is
+         * disabled in TIMESLOT_BEGIN_IRQHandler, once the radio is ours again. */
+        rx_drain();
+        m_state = STATE_IDLE;
+        return;
+    }
+
+    if (m_state == STATE_TX)
+    {
+        /* Let the packet in flight finish, so it is not sent again with a new packet ID next
+         * timeslot. TIMESLOT_BEGIN_IRQHandler stops UESB when its result comes in, or
+         * radio_callback does at the end of the timeslot. */
+        m_stats.slot.tx_end_waits++;
+        (void)nrf_atomic_u32_fetch_store(&m_end_deferred, 1);
+        return;
+    }
+
+    rx_listen_stop();
+
+    /* Keep payloads that were received but not handled yet. */
+    rx_drain();
+
+    /* Leave UESB initialized when it is idle, so the next timeslot only has to restore the RADIO.
+     * Its FIFOs and packet IDs are kept as they are: the Tx FIFO is empty between packets, and
+     * anything received after the drain above is read next timeslot. */
+    m_esb_parked = nrf_esb_is_idle();
+    if (!m_esb_parked)
+    {
+        err_code= nrf_esb_disable();
+        APP_ERROR_CHECK(err_code);
+    }
+
+    m_state                 = STATE_IDLE;
+}
+
+
+/**@brief Ends the timeslot early, between packets, so the next one can be requested.
+ *
+ * @details Stops UESB the same way as at the end of every timeslot, then moves the
+ *          end-of-timeslot timeout forward. radio_callback ends the timeslot from there and
+ *          requests the next one.
+ */
+static void timeslot_renew(void)
+{
+    if (m_state == STATE_IDLE)
+    {
+        /* Already stopped, for a failed extension. The timeslot ends at CC[0] anyway. */
+        return;
+    }
+
+    TIMESLOT_END_IRQHandler();
+
+    NRF_TIMER0->TASKS_CAPTURE[0] = 1;
+    NRF_TIMER0->CC[0]           += TS_RENEW_TRIGGER_US;
+}
+
+
+/**@brief Saves the RADIO configuration left by UESB initialization.
+ */
+static void radio_cfg_save(void)
+{
+    m_radio_cfg.txpower     = NRF_RADIO->TXPOWER;
+    m_radio_cfg.mode        = NRF_RADIO->MODE;
+#ifdef NRF52_SERIES
+    m_radio_cfg.modecnf0    = NRF_RADIO->MODECNF0;
+#endif
+    m_radio_cfg.pcnf0       = NRF_RADIO->PCNF0;
+    m_radio_cfg.pcnf1       = NRF_RADIO->PCNF1;
+    m_radio_cfg.base0       = NRF_RADIO->BASE0;
+    m_radio_cfg.base1       = NRF_RADIO->BASE1;
+    m_radio_cfg.prefix0     = NRF_RADIO->PREFIX0;
+    m_radio_cfg.prefix1     = NRF_RADIO->PREFIX1;
+    m_radio_cfg.txaddress   = NRF_RADIO->TXADDRESS;
+    m_radio_cfg.rxaddresses = NRF_RADIO->RXADDRESSES;
+    m_radio_cfg.crccnf      = NRF_RADIO->CRCCNF;
+    m_radio_cfg.crcpoly     = NRF_RADIO->CRCPOLY;
+    m_radio_cfg.crcinit     = NRF_RADIO->CRCINIT;
+    m_radio_cfg.tifs        = NRF_RADIO->TIFS;
+    m_radio_cfg.frequency   = NRF_RADIO->FREQUENCY;
+}
+
+
+/**@brief Writes back the RADIO configuration of UESB after the SoftDevice used the RADIO.
+ */
+static void radio_cfg_restore(void)
+{
+    NRF_RADIO->TXPOWER      = m_radio_cfg.txpower;
+    NRF_RADIO->MODE         = m_radio_cfg.mode;
+#ifdef NRF52_SERIES
+    NRF_RADIO->MODECNF0     = m_radio_cfg.modecnf0;
+#endif
+    NRF_RADIO->PCNF0        = m_radio_cfg.pcnf0;
+    NRF_RADIO->PCNF1        = m_radio_cfg.pcnf1;
+    NRF_RADIO->BASE0        = m_radio_cfg.base0;
+    NRF_RADIO->BASE1        = m_radio_cfg.base1;
+    NRF_RADIO->PREFIX0      = m_radio_cfg.prefix0;
+    NRF_RADIO->PREFIX1      = m_radio_cfg.prefix1;
+    NRF_RADIO->TXADDRESS    = m_radio_cfg.txaddress;
+    NRF_RADIO->RXADDRESSES  = m_radio_cfg.rxaddresses;
+    NRF_RADIO->CRCCNF       = m_radio_cfg.crccnf;
+    NRF_RADIO->CRCPOLY      = m_radio_cfg.crcpoly;
+    NRF_RADIO->CRCINIT      = m_radio_cfg.crcinit;
+    NRF_RADIO->TIFS         = m_radio_cfg.tifs;
+    NRF_RADIO->FREQUENCY    = m_radio_cfg.frequency;
+    NRF_RADIO->SHORTS       = 0;
+    NRF_RADIO->INTENCLR     = 0xFFFFFFFF;
+
+#ifdef NRF52832_XXAA
+    /* nRF52832 rev 2 errata 182, set by nrf_esb_init and cleared by the RADIO power cycle. Same
+     * variant check as nrf_esb_init. */
+    if ((NRF_FICR->INFO.VARIANT & 0x0000FF00) == 0x00004500)
+    {
+        RADIO_ERRATA_182_REG |= RADIO_ERRATA_182_BIT;
+    }
+#endif
+}
+
+
+/**@brief Records the time taken to get UESB ready at the start of a timeslot.
+ */
+static void esb_setup_record(uint32_t setup_us)
+{
+    if (m_slot_resumed)
+    {
+        m_stats.slot.esb_resumes++;
+        m_stats.slot.esb_resume_last_us = setup_us;
+        m_stats.slot.esb_resume_max_us  = MAX(m_stats.slot.esb_resume_max_us, setup_us);
+    }
+    else
+    {
+        m_stats.slot.esb_inits++;
+        m_stats.slot.esb_init_last_us = setup_us;
+        m_stats.slot.esb_init_max_us  = MAX(m_stats.slot.esb_init_max_us, setup_us);
+    }
+}
+
+
+/**@brief Records the time from the start of the timeslot to the first packet handed to UESB.
+ *
+ * @param[in] tx_time  TIMER0 time the packet was handed to UESB. TIMER0 starts at 0 with the timeslot.
+ */
+static void first_tx_record(uint32_t tx_time)
+{
+    uint32_t * p_avg_us = m_slot_resumed ? &m_stats.slot.first_tx_resume_avg_us : &m_stats.slot.first_tx_init_avg_us;
+
+    m_first_tx_pending = false;
+
+    *p_avg_us = (*p_avg_us == 0) ? tx_time : ((*p_avg_us * 7 + tx_time) / 8);
+    m_stats.slot.first_tx_last_us = tx_time;
+    m_stats.slot.first_tx_max_us  = MAX(m_stats.slot.first_tx_max_us, tx_time);
+}
+
+
+/**@brief Removes the packet handed to UESB once it is delivered or has failed too many times.
+ */
+static void tx_result_handle(void)
+{
+    tx_class_t * p_class = &m_tx_classes[m_tx_class];
+    tx_pipe_t *  p_pipe  = &p_class->pipes[m_tx_pipe];
+
+    switch (m_tx_result)
+    {
+        case TX_RESULT_SUCCESS:
+            /* Successful transmission. Can now remove packet from Tx FIFO, no need to copy it out.
+             * It stays queued if its payload was replaced while in flight. */
+            if (fifo_consume_view(&p_class->p_fifos[m_tx_pipe], &p_pipe->view))
+            {
+                m_stats.tx[m_tx_class].delivered_pkts++;
+                m_stats.pipe[m_tx_pipe].delivered_pkts++;
+                tx_deadline_update(p_pipe->view.hdr.id, true);
+            }
+
+            p_pipe->attempts = 0;
+            break;
+
+        case TX_RESULT_FAILED:
+            p_pipe->attempts += 1;
+            if (p_pipe->attempts >= MAX_TX_ATTEMPTS)
+            {
+                /* Max attempts reached, remove packet. */
+                NRF_LOG_INFO("FAILED TO SEND, NO ACK\r\n");
+                if (fifo_consume_view(&p_class->p_fifos[m_tx_pipe], &p_pipe->view))
+                {
+                    m_stats.tx[m_tx_class].dropped_pkts++;
+                    m_stats.pipe[m_tx_pipe].failed_pkts++;
+                    tx_deadline_update(p_pipe->view.hdr.id, false);
+                }
+
+                p_pipe->attempts = 0;
+            }
+            break;
+
+        default:
+            return;
+    }
+
+    m_tx_result = TX_RESULT_NONE;
+}
+
+
+/**@brief IRQHandler used for execution context management. 
+  *       Any available handler can be used as we're not using the associated hardware.
+  *       This handler is used to initiate UESB RX/TX.
+  */
+void TIMESLOT_BEGIN_IRQHandler(void)
+{
+    uint32_t err_code;
+    uint32_t setup_start;
+    nrf_esb_payload_t    tx_payload;
+    fifo_pkt_view_t      tx_view;
+    esb_timeslot_class_t tx_class;
+    tx_class_t *         p_class;
+    tx_pipe_t *          p_pipe;
+
+    tx_depth_sample();
+    tx_result_handle();
+    tx_deadline_expire();
+
+    if (!m_timeslot_active)
+    {
+        /* Pended by a Tx event right before the timeslot ended. */
+        if (nrf_atomic_u32_fetch_store(&m_end_deferred, 0) != 0)
+        {
+            TIMESLOT_END_IRQHandler();
+        }
+        return;
+    }
+
+    if (m_renew && m_state != STATE_TX)
+    {
+        /* No packet in flight: end the timeslot now, nothing queued or received is lost. */
+        timeslot_renew();
+        return;
+    }
+
+    if (m_state == STATE_IDLE)
+    {
+        NRF_TIMER0->TASKS_CAPTURE[3] = 1;
+        setup_start                  = NRF_TIMER0->CC[3];
+
+        m_slot_resumed = m_esb_parked;
+        if (m_esb_parked)
+        {
+            radio_cfg_restore();
+        }
+        else
+        {
+            if (m_esb_cut)
+            {
+                m_esb_cut = false;
+                err_code  = nrf_esb_disable();
+                APP_ERROR_CHECK(err_code);
+            }
+
+            err_code = nrf_esb_init(&nrf_esb_config);
+            APP_ERROR_CHECK(err_code);
+
+            err_code = nrf_esb_set_base_address_0(base_addr_0);
+            APP_ERROR_CHECK(err_code);
+
+            err_code = nrf_esb_set_base_address_1(base_addr_1);
+            APP_ERROR_CHECK(err_code);
+
+            err_code = nrf_esb_set_prefixes(addr_prefix, 8);
+            APP_ERROR_CHECK(err_code);
+
+            radio_cfg_save();
+            memset(m_pid_class, 0, sizeof(m_pid_class));
+        }
+
+        NRF_TIMER0->TASKS_CAPTURE[3] = 1;
+        esb_setup_record((NRF_TIMER0->CC[3] - setup_start) & 0x00FFFFFFUL);
+
+        m_state = STATE_READY;
+    }
+
+    if (m_state == STATE_TX)
+    {
+        /* Wait for the result of the packet in flight. */
+        return;
+    }
+
+    /* Read packet in place. Packet isn't removed until transmissions succeeds or max retries has been exceeded. */
+    tx_class = tx_class_select(&tx_view);
+    if (tx_class != ESB_TIMESLOT_CLASS_COUNT)
+    {
+        /* There are packets in a Tx FIFO: Start transmitting. */
+        p_class = &m_tx_classes[tx_class];
+        p_pipe  = &p_class->pipes[tx_view.hdr.pipe];
+        if (tx_view.idx != p_pipe->view.idx || memcmp(&tx_view.hdr, &p_pipe->view.hdr, sizeof(fifo_pkt_hdr_t)) != 0)
+        {
+            /* Not a retry: the previous packet of this class and pipe was removed or replaced. */
+            p_pipe->attempts = 0;
+            tx_delay_record(tx_class, tx_view.hdr.time);
+        }
+        else if (m_pid_class[tx_view.hdr.pipe] == tx_class + 1)
+        {
+            /* Sent again right after failing: keep its packet ID, so the receiver drops it if
+             * only the ACK was lost. */
+            err_code = nrf_esb_reuse_pid(tx_view.hdr.pipe);
+            APP_ERROR_CHECK(err_code);
+            m_stats.slot.pid_reuses++;
+        }
+        m_pid_class[tx_view.hdr.pipe] = tx_class + 1;
+        p_pipe->view     = tx_view;
+        p_class->rr_pipe = (tx_view.hdr.pipe + 1) % NRF_ESB_PIPE_COUNT;
+        m_tx_class       = tx_class;
+        m_tx_pipe        = tx_view.hdr.pipe;
+
+        tx_payload.length = tx_view.hdr.length;
+        tx_payload.pipe   = tx_view.hdr.pipe;
+        tx_payload.noack  = 0;
+        memcpy(tx_payload.data, tx_view.span[0].p_data, tx_view.span[0].len);
+        if (tx_view.span_cnt > 1)
+        {
+            memcpy(&tx_payload.data[tx_view.span[0].len], tx_view.span[1].p_data, tx_view.span[1].len);
+        }
+
+        rx_listen_stop();
+
+        m_tx_rec_len_avg = (m_tx_rec_len_avg * 7 + FIFO_PKT_REC_LEN(tx_payload.length)) / 8;
+
+        NRF_TIMER0->TASKS_CAPTURE[3] = 1;
+        m_tx_start_time              = NRF_TIMER0->CC[3];
+        m_tx_payload_len             = tx_payload.length;
+        if (m_first_tx_pending)
+        {
+            first_tx_record(m_tx_start_time);
+        }
+
+        err_code = nrf_esb_write_payload(&tx_payload);
+        APP_ERROR_CHECK(err_code);
+
+        m_state = STATE_TX;
+    }
+    else
+    {
+        /* No packets in the Tx FIFO: listen if an Rx window is open. */
+        rx_schedule();
+    }
+}
+
+
+/**@brief Atomically adds to a statistics counter updated from several contexts.
+ */
+static void stats_add(uint32_t * p_counter, uint32_t value)
+{
+    (void)nrf_atomic_u32_add((nrf_atomic_u32_t *)p_counter, value);
+}
+
+
+/**@brief Checks whether the oldest packet of a Tx FIFO is the one handed to UESB, and its result
+ *        is not handled yet.
+ */
+static bool tx_head_in_flight(esb_timeslot_class_t tx_class, uint32_t pipe)
+{
+    return (m_state == STATE_TX || m_tx_result != TX_RESULT_NONE) &&
+           m_tx_class == tx_class && m_tx_pipe == pipe &&
+           m_tx_classes[tx_class].p_fifos[pipe].start_idx == m_tx_classes[tx_class].pipes[pipe].view.idx;
+}
+
+
+/**@brief Puts packets in the Tx FIFO of their class and pipe, applying the overflow policy of the
+ *        class if they don't fit.
+ *
+ * @details The common case is a lock-free put. Making room means removing or changing queued
+ *          packets, which is otherwise only done by TIMESLOT_BEGIN_IRQHandler, so that is done
+ *          with its interrupt level masked. Counts one overflow per call that refuses or discards
+ *          the new data, or removes or replaces queued data.
+ */
+static uint32_t tx_enqueue(esb_timeslot_class_t tx_class, fifo_pkt_t const * p_pkts, uint32_t num_pkts)
+{
+    uint32_t                     pipe    = p_pkts[0].pipe;
+    fifo_t *                     p_fifo  = &m_tx_classes[tx_class].p_fifos[pipe];
+    esb_timeslot_queue_stats_t * p_stats = &m_stats.tx[tx_class];
+    bool                         success = false;
+    uint32_t                     start_time;
+    fifo_pkt_hdr_t               hdr;
+
+    if (fifo_put_many(p_fifo, p_pkts, num_pkts))
+    {
+        stats_add(&m_stats.pipe[pipe].queued_pkts, num_pkts);
+        return NRF_SUCCESS;
+    }
 
-        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_TIMER0:
-            if (NRF_TIMER0->EVENTS_COMPARE[0] &&
-                (NRF_TIMER0->INTENSET & (TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENCLR_COMPARE0_Pos)))
+    switch (m_tx_classes[tx_class].policy)
+    {
+        case ESB_TIMESLOT_OVERFLOW_DROP_NEWEST:
+            stats_add(&p_stats->overflows, 1);
+            stats_add(&p_stats->discarded_pkts, num_pkts);
+            tx_deadline_update(p_pkts[0].id, false);
+            return NRF_SUCCESS;
+
+        case ESB_TIMESLOT_OVERFLOW_OVERWRITE_KEY:
+            if (num_pkts == 1 && p_pkts[0].key != 0)
             {
-                NRF_TIMER0->TASKS_STOP        = 1;
-                NRF_TIMER0->EVENTS_COMPARE[0] = 0;
-                /* Workaround for issue that Softdevice doesn't reinitialize CC[1]&CC[2]*/
-                NRF_TIMER0->INTENCLR =TIMER_INTENSET_COMPARE2_Msk|TIMER_INTENSET_COMPARE1_Msk;
-                NRF_TIMER0->CC[1]=0;
-                NRF_TIMER0->CC[2]=0;
-                /* This is the "timeslot is about to end" timeout. */
-                if (!nrf_esb_is_idle())
+                CRITICAL_REGION_ENTER();
+                success = fifo_overwrite_key(p_fifo, p_pkts[0].key, p_pkts[0].p_data, p_pkts[0].length);
+                CRITICAL_REGION_EXIT();
+
+                if (success)
                 {
-                    NRF_RADIO->INTENCLR      = 0xFFFFFFFF;
-                    NRF_RADIO->TASKS_DISABLE = 1;
+                    stats_add(&p_stats->overflows, 1);
+                    stats_add(&p_stats->overwritten_pkts, 1);
+                    return NRF_SUCCESS;
                 }
-		//nrf_gpio_pin_toggle(29);	
-                /* Schedule next timeslot. */
-                configure_next_event_earliest();
-                signal_callback_return_param.params.request.p_next = &m_timeslot_request;
-                signal_callback_return_param.callback_action       = NRF_RADIO_SIGNAL_CALLBACK_ACTION_REQUEST_AND_END;
             }
+            /* No packet to replace: make room like ESB_TIMESLOT_OVERFLOW_DROP_OLDEST. */
+            // Fall through
 
-            if (NRF_TIMER0->EVENTS_COMPARE[1] &&
-                (NRF_TIMER0->INTENSET & (TIMER_INTENSET_COMPARE1_Enabled << TIMER_INTENCLR_COMPARE1_Pos)))
+        case ESB_TIMESLOT_OVERFLOW_DROP_OLDEST:
+            CRITICAL_REGION_ENTER();
+            while (!(success = fifo_put_many(p_fifo, p_pkts, num_pkts)))
             {
-                //nrf_gpio_pin_toggle(30);	
-                NRF_TIMER0->EVENTS_COMPARE[1] = 0;
-
-                /* This is the "Time to extend timeslot" timeout. */
-                if (m_total_timeslot_length < (128000000UL - 1UL - TX_LEN_EXTENSION_US))
+                /* Stops when nothing is left to remove, e.g. other callers are still writing, or
+                 * when the oldest packet is in flight and would otherwise be counted twice. */
+                if (tx_head_in_flight(tx_class, pipe) || !fifo_peek_hdr(p_fifo, &hdr) || fifo_consume(p_fifo, 1) == 0)
                 {
-                    /* Request timeslot extension if total length does not exceed 128 seconds. */
-                    signal_callback_return_param.params.extend.length_us = TX_LEN_EXTENSION_US;
-                    signal_callback_return_param.callback_action         = NRF_RADIO_SIGNAL_CALLBACK_ACTION_EXTEND;
-                }
-                else
-                {
-                    /* Return with no action request. */
-                
+                    break;
                 }
+                p_stats->evicted_pkts++;
+                tx_deadline_update(hdr.id, false);
             }
-            break;
-
-        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_EXTEND_SUCCEEDED:
-            //nrf_gpio_pin_toggle(31);	
-            NRF_TIMER0->TASKS_STOP          = 1;
-            NRF_TIMER0->EVENTS_COMPARE[0]   = 0;
-            NRF_TIMER0->EVENTS_COMPARE[1]   = 0;
-            NRF_TIMER0->CC[0]              += (TX_LEN_EXTENSION_US - 25);
-            NRF_TIMER0->CC[1]              += (TX_LEN_EXTENSION_US - 25);
-            NRF_TIMER0->TASKS_START         = 1;
+            CRITICAL_REGION_EXIT();
 
-            m_total_timeslot_length += TX_LEN_EXTENSION_US;
-            NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
-        
+            /* Room was made, or the new data is refused below. */
+            if (success)
+            {
+                stats_add(&p_stats->overflows, 1);
+            }
             break;
 
-        case NRF_RADIO_CALLBACK_SIGNAL_TYPE_EXTEND_FAILED:
-            /* Tried scheduling a new timeslot, but failed. */
-            /* Disabling UESB is done in a lower interrupt priority. */
-            /* Call TIMESLOT_END_IRQHandler later. */
-            NVIC_SetPendingIRQ(TIMESLOT_END_IRQn);
-            //nrf_gpio_pin_toggle(29);	
+        case ESB_TIMESLOT_OVERFLOW_BLOCK:
+            stats_add(&p_stats->blocked_sends, 1);
+            start_time = app_timer_cnt_get();
+            do
+            {
+                success = fifo_put_many(p_fifo, p_pkts, num_pkts);
+            } while (!success && app_timer_cnt_diff_compute(app_timer_cnt_get(), start_time) < m_tx_classes[tx_class].block_timeout_ticks);
+
+            if (!success)
+            {
+                stats_add(&p_stats->block_timeouts, 1);
+            }
             break;
 
         default:
-            /* No implementation needed. */
             break;
     }
-    //default return action is NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE
-    return (&signal_callback_return_param);
+
+    if (success)
+    {
+        stats_add(&m_stats.pipe[pipe].queued_pkts, num_pkts);
+        return NRF_SUCCESS;
+    }
+
+    stats_add(&p_stats->overflows, 1);
+    stats_add(&p_stats->rejected_pkts, num_pkts);
+    return NRF_ERROR_NO_MEM;
 }
 
 
-uint32_t esb_timeslot_sd_start(void)
+/**@brief Gives a queued message its identifier, unique among the queued messages.
+ */
+static uint32_t tx_msg_id_new(void)
 {
-    uint32_t err_code;
+    return nrf_atomic_u32_add(&m_tx_msg_id, 1);
+}
 
-    err_code = sd_radio_session_open(radio_callback);
-    if (err_code != NRF_SUCCESS)
+
+/**@brief Queues a string, split into ESB payloads, and wakes the session if needed.
+ *
+ * @param[in] now RTC time the string is queued at, stored with each payload.
+ * @param[in] id  Message identifier, stored with each payload.
+ */
+static uint32_t str_send(uint8_t * p_str, uint32_t length, uint8_t pipe, esb_timeslot_class_t tx_class, uint32_t now, uint32_t id)
+{
+    fifo_pkt_t pkts[MAX_TX_CHUNKS];
+    uint32_t   num_pkts = 0;
+    uint32_t   rec_len  = 0;
+    uint32_t   err_code;
+
+    /* Split strings longer than one ESB payload. All parts are queued under one claim, so they
+     * stay in order even if other callers queue data at the same time. */
+    do
     {
-        return err_code;
+        pkts[num_pkts].p_data = p_str;
+        pkts[num_pkts].length = MIN(length, NRF_ESB_MAX_PAYLOAD_LENGTH);
+        pkts[num_pkts].pipe   = pipe;
+        pkts[num_pkts].key    = 0;
+        pkts[num_pkts].time   = now;
+        pkts[num_pkts].id     = id;
+
+        p_str   += pkts[num_pkts].length;
+        length  -= pkts[num_pkts].length;
+        rec_len += FIFO_PKT_REC_LEN(pkts[num_pkts].length);
+        num_pkts++;
+    } while (length > 0);
+
+    if (rec_len > FIFO_SIZE(&m_tx_classes[tx_class].p_fifos[pipe]))
+    {
+        /* Would never fit, whatever the overflow policy removes. */
+        return NRF_ERROR_INVALID_LENGTH;
     }
 
-    err_code = request_next_event_earliest();
-    if (err_code != NRF_SUCCESS)
+    /* Only the payload bytes are queued. The FIFO is lock-free, so no critical region is needed
+     * even with several callers. */
+    err_code = tx_enqueue(tx_class, pkts, num_pkts);
+    if (err_code == NRF_SUCCESS)
     {
-        (void)sd_radio_session_close();
-        return err_code;
+        timeslot_wake();
     }
 
-    return NRF_SUCCESS;
+    return err_code;
 }
 
 
-
-uint32_t esb_timeslot_sd_stop(void)
+uint32_t esb_timeslot_send_str(uint8_t * p_str, uint32_t length, uint8_t pipe, esb_timeslot_class_t tx_class)
 {
-    return sd_radio_session_close();
+    if (pipe >= NRF_ESB_PIPE_COUNT || tx_class >= ESB_TIMESLOT_CLASS_COUNT)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    if (length > (MAX_TX_CHUNKS * NRF_ESB_MAX_PAYLOAD_LENGTH))
+    {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    return str_send(p_str, length, pipe, tx_class, app_timer_cnt_get(), tx_msg_id_new());
 }
 
 
-/**@brief IRQHandler used for execution context management. 
-  *       Any available handler can be used as we're not using the associated hardware.
-  *       This handler is used to stop and disable UESB.
-  */
-void TIMESLOT_END_IRQHandler(void)
+uint32_t esb_timeslot_send_deadline(uint8_t * p_str, uint32_t length, uint8_t pipe, esb_timeslot_class_t tx_class, uint32_t deadline_ms)
 {
-    uint32_t err_code;
+    tx_deadline_t * p_entry = NULL;
+    uint32_t        now     = app_timer_cnt_get();
+    uint32_t        id      = tx_msg_id_new();
+    uint32_t        chunks;
+    uint32_t        needed_us;
+    uint32_t        err_code;
+
+    if (pipe >= NRF_ESB_PIPE_COUNT || tx_class >= ESB_TIMESLOT_CLASS_COUNT || deadline_ms > TX_DEADLINE_MAX_MS)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
 
-       /* Timeslot is about to end: stop UESB. */
-    if (m_state == STATE_RX)
-    {  
-        err_code= nrf_esb_stop_rx();
+    if (length > (MAX_TX_CHUNKS * NRF_ESB_MAX_PAYLOAD_LENGTH))
+    {
+        return NRF_ERROR_INVALID_LENGTH;
     }
 
-    err_code= nrf_esb_flush_tx();
-    APP_ERROR_CHECK(err_code);
+    /* Sending everything queued, then this message, must fit in the deadline. */
+    chunks    = MAX(CEIL_DIV(length, NRF_ESB_MAX_PAYLOAD_LENGTH), 1);
+    needed_us = tx_backlog_us() + chunks * m_tx_airtime_us + (m_timeslot_active ? 0 : TS_DEADLINE_START_US);
+    if (needed_us > deadline_ms * 1000UL)
+    {
+        stats_add(&m_stats.tx[tx_class].deadline_rejected, 1);
+        return NRF_ERROR_TIMEOUT;
+    }
 
-    err_code= nrf_esb_flush_rx();
-    APP_ERROR_CHECK(err_code);
+    CRITICAL_REGION_ENTER();
+    for (uint32_t i = 0; i < TX_DEADLINE_MAX; i++)
+    {
+        if (m_tx_deadlines[i].chunks == 0)
+        {
+            p_entry           = &m_tx_deadlines[i];
+            p_entry->deadline = (now + APP_TIMER_TICKS(deadline_ms)) & APP_TIMER_MAX_CNT_VAL;
+            p_entry->id       = id;
+            p_entry->pipe     = pipe;
+            p_entry->tx_class = tx_class;
+            p_entry->chunks   = chunks;
+            break;
+        }
+    }
+    CRITICAL_REGION_EXIT();
 
-    err_code= nrf_esb_disable();
-    APP_ERROR_CHECK(err_code);
+    if (p_entry == NULL)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
 
-    m_total_timeslot_length = 0;
-    m_state                 = STATE_IDLE;
+    err_code = str_send(p_str, length, pipe, tx_class, now, id);
+    if (err_code != NRF_SUCCESS)
+    {
+        p_entry->chunks = 0;
+    }
 
-   
+    return err_code;
 }
 
 
-/**@brief IRQHandler used for execution context management. 
-  *       Any available handler can be used as we're not using the associated hardware.
-  *       This handler is used to initiate UESB RX/TX.
-  */
-void TIMESLOT_BEGIN_IRQHandler(void)
+uint32_t esb_timeslot_send_keyed(uint8_t * p_data, uint32_t length, uint8_t key, uint8_t pipe, esb_timeslot_class_t tx_class)
 {
-    uint32_t err_code;
-    nrf_esb_payload_t tx_payload ;
-    uint32_t          tx_payload_len;
+    fifo_pkt_t pkt;
+    uint32_t   err_code;
 
-    if (m_state == STATE_IDLE)
+    if (pipe >= NRF_ESB_PIPE_COUNT || tx_class >= ESB_TIMESLOT_CLASS_COUNT)
     {
+        return NRF_ERROR_INVALID_PARAM;
+    }
 
-        err_code = nrf_esb_init(&nrf_esb_config);
-        APP_ERROR_CHECK(err_code);
-
-        err_code = nrf_esb_set_base_address_0(base_addr_0);
-        APP_ERROR_CHECK(err_code);
+    if (length > NRF_ESB_MAX_PAYLOAD_LENGTH)
+    {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
 
-        err_code = nrf_esb_set_base_address_1(base_addr_1);
-        APP_ERROR_CHECK(err_code);
+    pkt.p_data = p_data;
+    pkt.length = (uint8_t)length;
+    pkt.pipe   = pipe;
+    pkt.key    = key;
+    pkt.time   = app_timer_cnt_get();
+    pkt.id     = tx_msg_id_new();
 
-        err_code = nrf_esb_set_prefixes(addr_prefix, 8);
-        APP_ERROR_CHECK(err_code);
+    err_code = tx_enqueue(tx_class, &pkt, 1);
+    if (err_code == NRF_SUCCESS)
+    {
+        timeslot_wake();
     }
 
-    CRITICAL_REGION_ENTER();
-    if (m_transmit_fifo.free_items < sizeof(m_transmit_fifo.buf) && m_state != STATE_TX)
-    {
-        /* There are packets in the Tx FIFO: Start transmitting. */
-        tx_payload_len = sizeof(tx_payload);
+    return err_code;
+}
 
-        /* Copy packet from FIFO. Packet isn't removed until transmissions succeeds or max retries has been exceeded. */
-        if (m_tx_attempts < MAX_TX_ATTEMPTS)
-        {        
-            fifo_peek_pkt(&m_transmit_fifo, (uint8_t *) &tx_payload, &tx_payload_len);
-            APP_ERROR_CHECK_BOOL(tx_payload_len == sizeof(tx_payload));
-        }
-        else
-        {
-            /* Max attempts reached, remove packet. */
-            NRF_LOG_INFO("FAILED TO SEND, NO ACK\r\n");
-            fifo_get_pkt(&m_transmit_fifo, (uint8_t *) &tx_payload, &tx_payload_len);
-            APP_ERROR_CHECK_BOOL(tx_payload_len == sizeof(tx_payload));
 
-            m_tx_attempts = 0;
-        }
+uint32_t esb_timeslot_class_weight_set(esb_timeslot_class_t tx_class, uint32_t weight)
+{
+    if (tx_class == ESB_TIMESLOT_CLASS_CONTROL || tx_class >= ESB_TIMESLOT_CLASS_COUNT || weight == 0)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
 
-        if (m_state == STATE_RX)
-        {
-            nrf_esb_stop_rx(); 
-        }
+    m_tx_classes[tx_class].weight = weight;
 
-        err_code = nrf_esb_write_payload(&tx_payload);
-        APP_ERROR_CHECK(err_code);
+    return NRF_SUCCESS;
+}
 
-        m_state = STATE_TX;
-    }
-    else 
-    if (m_state != STATE_RX)
+
+uint32_t esb_timeslot_overflow_policy_set(esb_timeslot_class_t           tx_class,
+                                          esb_timeslot_overflow_policy_t policy,
+                                          uint32_t                       block_timeout_ms)
+{
+    if (tx_class >= ESB_TIMESLOT_CLASS_COUNT || policy > ESB_TIMESLOT_OVERFLOW_BLOCK)
     {
-        /* No packets in the Tx FIFO: start reception */
-        err_code = nrf_esb_start_rx();
-        APP_ERROR_CHECK(err_code);
-        m_state = STATE_RX;
+        return NRF_ERROR_INVALID_PARAM;
     }
-    CRITICAL_REGION_EXIT();
+
+    m_tx_classes[tx_class].block_timeout_ticks = APP_TIMER_TICKS(block_timeout_ms);
+    m_tx_classes[tx_class].policy              = policy;
+
+    return NRF_SUCCESS;
 }
 
 
-uint32_t esb_timeslot_send_str(uint8_t * p_str, uint32_t length)
+/**@brief Adds the airtime of the transmit attempt that just finished to the running average, and
+ *        splits it into time spent transmitting and waiting for acknowledgements.
+ *
+ * @param[in] tx_attempts Number of times the packet was sent, retransmits included.
+ */
+static void tx_airtime_sample(uint32_t tx_attempts)
 {
-    static nrf_esb_payload_t tx_payload;
-    bool success;
+    uint32_t airtime_us;
+    uint32_t tx_us;
+    uint32_t us_per_byte = (nrf_esb_config.bitrate == NRF_ESB_BITRATE_2MBPS) ? 4 : 8;
 
-    memset(&tx_payload, 0, sizeof(tx_payload));
-    memcpy(tx_payload.data, p_str, length);
-    tx_payload.length = length;
-    tx_payload.pipe   = 0;
+    NRF_TIMER0->TASKS_CAPTURE[3] = 1;
+    airtime_us = (NRF_TIMER0->CC[3] - m_tx_start_time) & 0x00FFFFFFUL;
 
-    CRITICAL_REGION_ENTER();
-    success = fifo_put_pkt(&m_transmit_fifo, (uint8_t *)&tx_payload, sizeof(tx_payload));
-    CRITICAL_REGION_EXIT();
-    
-    return (success? NRF_SUCCESS: NRF_ERROR_NO_MEM);
+    m_tx_airtime_us = (m_tx_airtime_us * 7 + airtime_us) / 8;
+    m_stats.slot.tx_airtime_us = m_tx_airtime_us;
+
+    /* The rest of the airtime is spent waiting for, and receiving, acknowledgements. */
+    tx_us          = MIN(tx_attempts * (TX_RAMP_UP_US + (m_tx_payload_len + TX_FRAME_OVERHEAD_BYTES) * us_per_byte), airtime_us);
+    m_slot_tx_us  += tx_us;
+    m_slot_ack_us += airtime_us - tx_us;
 }
 
 
 void nrf_esb_event_handler(nrf_esb_evt_t const * p_event)
 {
+    /* The Tx FIFO is only read and updated in TIMESLOT_BEGIN_IRQHandler. Call it now to handle
+     * the result and start on the next packet without waiting for the next extension. */
+    if (p_event->evt_id == NRF_ESB_EVENT_TX_SUCCESS || p_event->evt_id == NRF_ESB_EVENT_TX_FAILED)
+    {
+        tx_airtime_sample(p_event->tx_attempts);
+    }
+
     if (p_event->evt_id == NRF_ESB_EVENT_TX_FAILED)
     { 
         nrf_esb_flush_tx();
 
-        m_tx_attempts += 1;
-        m_state        = STATE_RX;
+        m_tx_result = TX_RESULT_FAILED;
+        m_state     = STATE_READY;
+        NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
     }
 
     if (p_event->evt_id == NRF_ESB_EVENT_TX_SUCCESS)
     {
-        nrf_esb_payload_t payload;
-        uint32_t          payload_len;
-
-        /* Successful transmission. Can now remove packet from Tx FIFO. */
-        payload_len = sizeof(payload);
-
-        fifo_get_pkt(&m_transmit_fifo, (uint8_t *) &payload, &payload_len);
-        APP_ERROR_CHECK_BOOL(payload_len == sizeof(payload));
-
-        m_tx_attempts = 0;
+        m_tx_result = TX_RESULT_SUCCESS;
+        m_state     = STATE_READY;
+        NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
     }
 
     if (p_event->evt_id & NRF_ESB_EVENT_RX_RECEIVED)
     {
+        if (m_rx_sync)
+        {
+            m_rx_sync_time    = app_timer_cnt_get();
+            m_rx_sync_pending = true;
+        }
+
         /* Data reception is handled in a lower priority interrup. */
         /* Call UESB_RX_HANDLE_IRQHandler later. */
         NVIC_SetPendingIRQ(UESB_RX_HANDLE_IRQn);
@@ -424,6 +2581,7 @@ void nrf_esb_event_handler(nrf_esb_evt_t const * p_event)
 uint32_t esb_timeslot_init(ut_data_handler_t evt_handler)
 {
     nrf_esb_config_t tmp_config = NRF_ESB_DEFAULT_CONFIG;
+    uint32_t         err_code;
 
     m_evt_handler = evt_handler;
 
@@ -436,7 +2594,14 @@ uint32_t esb_timeslot_init(ut_data_handler_t evt_handler)
     nrf_esb_config.selective_auto_ack = false;
     nrf_esb_config.radio_irq_priority = 0;
 
-    fifo_init(&m_transmit_fifo);
+    FIFO_ARRAY_INIT(m_tx_control_fifos);
+    FIFO_ARRAY_INIT(m_tx_telemetry_fifos);
+    FIFO_ARRAY_INIT(m_tx_bulk_fifos);
+    for (uint32_t i = 0; i < ESB_TIMESLOT_CLASS_COUNT; i++)
+    {
+        m_tx_classes[i].depth_time = app_timer_cnt_get();
+    }
+    fifo_init(&m_receive_fifo);
 
     // Using three avilable interrupt handlers for interrupt level management
     // These can be any available IRQ as we're not using any of the hardware,
@@ -453,6 +2618,40 @@ uint32_t esb_timeslot_init(ut_data_handler_t evt_handler)
     NVIC_SetPriority(UESB_RX_HANDLE_IRQn, 2);
     NVIC_EnableIRQ(UESB_RX_HANDLE_IRQn);
 
+    NVIC_ClearPendingIRQ(TIMESLOT_WAKE_IRQn);
+    NVIC_SetPriority(TIMESLOT_WAKE_IRQn, TIMESLOT_WAKE_IRQPriority);
+    NVIC_EnableIRQ(TIMESLOT_WAKE_IRQn);
+
+    err_code = app_timer_create(&m_rx_window_timer, APP_TIMER_MODE_REPEATED, rx_window_timeout_handler);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = app_timer_create(&m_recover_timer, APP_TIMER_MODE_SINGLE_SHOT, recover_timeout_handler);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = app_timer_create(&m_retry_timer, APP_TIMER_MODE_SINGLE_SHOT, retry_timeout_handler);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = app_timer_create(&m_time_sample_timer, APP_TIMER_MODE_REPEATED, time_sample_timeout_handler);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = app_timer_start(m_time_sample_timer, APP_TIMER_TICKS(TS_TIME_SAMPLE_INTERVAL_MS), NULL);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
 
     /*
     nrf_gpio_cfg_output(28);
@@ -468,17 +2667,142 @@ uint32_t esb_timeslot_init(ut_data_handler_t evt_handler)
 }
 
 
-void UESB_RX_HANDLE_IRQHandler(void)
+/**@brief Passes received packets to the application in main context.
+ */
+static void rx_dispatch(void * p_event_data, uint16_t event_size)
+{
+    uint8_t    data[RX_DISPATCH_BATCH][NRF_ESB_MAX_PAYLOAD_LENGTH];
+    fifo_pkt_t pkts[RX_DISPATCH_BATCH];
+    uint32_t   num_pkts;
+
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+
+    /* Cleared first so that packets drained from now on schedule a new dispatch. */
+    m_rx_dispatch_pending = false;
+
+    do
+    {
+        for (uint32_t i = 0; i < RX_DISPATCH_BATCH; i++)
+        {
+            pkts[i].p_data = data[i];
+            pkts[i].length = sizeof(data[i]);
+        }
+
+        num_pkts = fifo_get_many(&m_receive_fifo, pkts, RX_DISPATCH_BATCH);
+
+        for (uint32_t i = 0; i < num_pkts; i++)
+        {
+            m_evt_handler(pkts[i].p_data, pkts[i].length);
+        }
+    } while (num_pkts == RX_DISPATCH_BATCH);
+}
+
+
+/**@brief Moves every payload in the UESB Rx FIFO to the Rx FIFO and schedules their dispatch.
+ */
+static void rx_drain(void)
 {
     nrf_esb_payload_t rx_payload;
+    uint32_t          drained = 0;
+    uint32_t          err_code;
+
+    while (nrf_esb_read_rx_payload(&rx_payload) == NRF_SUCCESS)
+    {
+        if (fifo_put_pkt(&m_receive_fifo, rx_payload.pipe, rx_payload.data, rx_payload.length))
+        {
+            drained++;
+        }
+        else
+        {
+            m_stats.rx.fifo_full_drops++;
+        }
+    }
+
+    if (drained == 0)
+    {
+        return;
+    }
+
+    m_stats.rx.drain_runs++;
+    m_stats.rx.drained_pkts   += drained;
+    m_stats.rx.last_drain_cnt  = drained;
+    m_stats.rx.max_drain_cnt   = MAX(m_stats.rx.max_drain_cnt, drained);
+    m_stats.rx.drain_hist[MIN(drained, ESB_TIMESLOT_DRAIN_HIST_LEN) - 1]++;
 
-    /* Get packet from UESB buffer. */
-    nrf_esb_read_rx_payload(&rx_payload);
+    if (!m_rx_dispatch_pending)
+    {
+        m_rx_dispatch_pending = true;
+
+        err_code = app_sched_event_put(NULL, 0, rx_dispatch);
+        if (err_code != NRF_SUCCESS)
+        {
+            /* Scheduler queue is full, try again on the next drain. */
+            m_rx_dispatch_pending = false;
+        }
+    }
+}
 
-    /* Pass tje receoved data to main application. */
-    /* app_scheduler may be used instead to send the event in main context.*/
-    m_evt_handler(rx_payload.data,rx_payload.length);
 
+void UESB_RX_HANDLE_IRQHandler(void)
+{
+    /* Get every packet from UESB buffer, not just the one that triggered the interrupt. */
+    /* Received data is passed to main application in main context through app_scheduler. */
+    rx_drain();
 }
 
 
+void esb_timeslot_stats_get(esb_timeslot_stats_t * p_stats)
+{
+    CRITICAL_REGION_ENTER();
+    tx_depth_sample();
+    session_time_sample();
+    m_stats.slot.ble_interval_us = m_ble_interval_us;
+    m_stats.util.used_permille   = (m_stats.util.granted_time_us > 0) ?
+                                   (uint32_t)(((m_stats.util.granted_time_us - m_stats.util.idle_time_us) * 1000) / m_stats.util.granted_time_us) : 0;
+
+    for (uint32_t i = 0; i < ESB_TIMESLOT_CLASS_COUNT; i++)
+    {
+        tx_class_t * p_class = &m_tx_classes[i];
+
+        m_stats.tx[i].capacity     = FIFO_SIZE(&p_class->p_fifos[0]);
+        m_stats.tx[i].depth        = p_class->depth;
+        m_stats.tx[i].max_depth    = 0;
+        m_stats.tx[i].avg_depth    = (p_class->depth_ticks > 0) ? (uint32_t)(p_class->depth_area / p_class->depth_ticks) : 0;
+        m_stats.tx[i].delay_avg_us = (p_class->delay_cnt > 0) ? (uint32_t)(p_class->delay_sum_us / p_class->delay_cnt) : 0;
+    }
+
+    for (uint32_t pipe = 0; pipe < NRF_ESB_PIPE_COUNT; pipe++)
+    {
+        m_stats.pipe[pipe].depth = 0;
+
+        for (uint32_t i = 0; i < ESB_TIMESLOT_CLASS_COUNT; i++)
+        {
+            fifo_t * p_fifo = &m_tx_classes[i].p_fifos[pipe];
+
+            m_stats.tx[i].max_depth   = MAX(m_stats.tx[i].max_depth, p_fifo->max_used);
+            m_stats.pipe[pipe].depth += fifo_num_elem_get(p_fifo);
+        }
+    }
+
+    m_stats.rx.listen_pkts       = m_stats.rx.drained_pkts - m_rx_cfg_pkts;
+    m_stats.rx.listen_us_per_pkt = (m_stats.rx.listen_pkts > 0) ? (uint32_t)(m_stats.rx.listen_time_us / m_stats.rx.listen_pkts) : 0;
+
+    /* A packet sent at a random time outside a window waits for the next one. */
+    if (m_rx_period_us != 0)
+    {
+        uint32_t closed_us = m_rx_period_us - m_rx_window_us;
+
+        m_stats.rx.added_latency_avg_us = (uint32_t)(((uint64_t)closed_us * closed_us) / (2 * m_rx_period_us));
+        m_stats.rx.added_latency_max_us = closed_us;
+    }
+    else
+    {
+        m_stats.rx.added_latency_avg_us = 0;
+        m_stats.rx.added_latency_max_us = 0;
+    }
+
+    memcpy(p_stats, &m_stats, sizeof(m_stats));
+    CRITICAL_REGION_EXIT();
+}
+
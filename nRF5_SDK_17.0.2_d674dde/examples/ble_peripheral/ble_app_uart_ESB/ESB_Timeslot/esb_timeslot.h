@@ -17,6 +17,186 @@
 typedef void (*ut_data_handler_t)(void * p_data, uint16_t length);
 
 
+#define ESB_TIMESLOT_DRAIN_HIST_LEN     8       /**< Number of buckets in @ref esb_timeslot_rx_stats_t::drain_hist. */
+#define ESB_TIMESLOT_START_HIST_LEN     10      /**< Number of buckets in @ref esb_timeslot_slot_stats_t::start_delay_hist. */
+
+
+/**@brief Traffic classes, each with its own transmit queue.
+ */
+typedef enum
+{
+    ESB_TIMESLOT_CLASS_CONTROL,         /**< Latency-critical frames, always sent before the other classes. */
+    ESB_TIMESLOT_CLASS_TELEMETRY,       /**< Periodic data, shares the radio with ESB_TIMESLOT_CLASS_BULK by weight. */
+    ESB_TIMESLOT_CLASS_BULK,            /**< Everything else, e.g. UART text. */
+    ESB_TIMESLOT_CLASS_COUNT            /**< Number of traffic classes. */
+} esb_timeslot_class_t;
+
+
+/**@brief What to do with data sent while the transmit queue is full.
+ */
+typedef enum
+{
+    ESB_TIMESLOT_OVERFLOW_REJECT,       /**< Refuse the new data with NRF_ERROR_NO_MEM (default). */
+    ESB_TIMESLOT_OVERFLOW_DROP_NEWEST,  /**< Discard the new data but report success. */
+    ESB_TIMESLOT_OVERFLOW_DROP_OLDEST,  /**< Remove the oldest queued packets until the new data fits. A packet being sent is not removed. */
+    ESB_TIMESLOT_OVERFLOW_OVERWRITE_KEY,/**< Replace the newest queued packet with the same key, see @ref esb_timeslot_send_keyed. Otherwise as ESB_TIMESLOT_OVERFLOW_DROP_OLDEST. */
+    ESB_TIMESLOT_OVERFLOW_BLOCK         /**< Wait for room until a timeout, then refuse the new data. */
+} esb_timeslot_overflow_policy_t;
+
+
+/**@brief Receive path statistics.
+ */
+typedef struct
+{
+    uint32_t drain_runs;                                /**< Number of runs that moved at least one payload from the UESB Rx FIFO. */
+    uint32_t drained_pkts;                              /**< Total number of payloads moved. */
+    uint32_t last_drain_cnt;                            /**< Number of payloads moved by the latest run. */
+    uint32_t max_drain_cnt;                             /**< Largest number of payloads moved by a single run. */
+    uint32_t drain_hist[ESB_TIMESLOT_DRAIN_HIST_LEN];   /**< Runs by number of payloads moved: n payloads in bucket n-1, the last bucket also counts larger runs. */
+    uint32_t fifo_full_drops;                           /**< Payloads lost because the Rx FIFO was full. */
+    uint32_t windows;                                   /**< Times reception was started with the current Rx schedule. */
+    uint64_t listen_time_us;                            /**< Time spent receiving with the current Rx schedule. */
+    uint32_t listen_pkts;                               /**< Payloads received with the current Rx schedule. */
+    uint32_t listen_us_per_pkt;                         /**< Receive time per received payload. Times the Rx current, this is the energy per packet. */
+    uint32_t added_latency_avg_us;                      /**< Average wait for the next Rx window of a packet sent at a random time. */
+    uint32_t added_latency_max_us;                      /**< Longest wait for the next Rx window. */
+} esb_timeslot_rx_stats_t;
+
+
+/**@brief Transmit queue statistics.
+ */
+typedef struct
+{
+    uint32_t capacity;                                  /**< Size of the queue of each pipe in bytes. */
+    uint32_t depth;                                     /**< Bytes queued for all pipes at the time of the snapshot. */
+    uint32_t max_depth;                                 /**< High-water mark in bytes of the fullest pipe queue. */
+    uint32_t avg_depth;                                 /**< Time-weighted average of depth in bytes. */
+    uint32_t overflows;                                 /**< Number of sends whose data did not fit in the queue and that refused or discarded it, or removed or replaced queued data. */
+    uint32_t dropped_pkts;                              /**< Packets removed after too many failed transmit attempts. */
+    uint32_t delivered_pkts;                            /**< Packets acknowledged by the receiver. */
+    uint32_t rejected_pkts;                             /**< Packets refused with NRF_ERROR_NO_MEM. */
+    uint32_t discarded_pkts;                            /**< New packets discarded by ESB_TIMESLOT_OVERFLOW_DROP_NEWEST. */
+    uint32_t evicted_pkts;                              /**< Queued packets removed to make room for new ones. */
+    uint32_t overwritten_pkts;                          /**< Queued packets replaced by a newer one with the same key. */
+    uint32_t blocked_sends;                             /**< Sends that had to wait for room with ESB_TIMESLOT_OVERFLOW_BLOCK. */
+    uint32_t block_timeouts;                            /**< Waits that timed out. */
+    uint32_t delay_last_us;                             /**< Time the latest packet waited in the queue before its first transmit attempt. */
+    uint32_t delay_avg_us;                              /**< Average of those waits. */
+    uint32_t delay_max_us;                              /**< Longest of those waits. */
+    uint32_t deadline_met;                              /**< Messages sent with @ref esb_timeslot_send_deadline delivered in time. */
+    uint32_t deadline_missed;                           /**< Such messages delivered late, dropped, evicted or discarded by the overflow policy, or still queued at their deadline. */
+    uint32_t deadline_rejected;                         /**< Such messages not queued because their deadline could not be met. */
+} esb_timeslot_queue_stats_t;
+
+
+/**@brief Transmit statistics of a pipe, over all traffic classes.
+ */
+typedef struct
+{
+    uint32_t queued_pkts;                               /**< Packets accepted for transmission. */
+    uint32_t delivered_pkts;                            /**< Packets acknowledged by the receiver. */
+    uint32_t failed_pkts;                               /**< Packets removed after too many failed transmit attempts. */
+    uint32_t depth;                                     /**< Bytes queued at the time of the snapshot. */
+} esb_timeslot_pipe_stats_t;
+
+
+/**@brief Timeslot statistics.
+ */
+typedef struct
+{
+    uint32_t last_request_us;                           /**< Length of the latest timeslot request. */
+    uint32_t last_extension_us;                         /**< Length of the latest extension request. */
+    uint32_t tx_airtime_us;                             /**< Average airtime of a transmit attempt, used to size requests. */
+    uint32_t blocked_cnt;                               /**< Requests the SoftDevice could not schedule. */
+    uint32_t canceled_cnt;                              /**< Scheduled timeslots the SoftDevice cancelled. */
+    uint32_t periodic_slots;                            /**< Timeslots started from a periodic (normal) request. */
+    uint32_t period_jitter_last_us;                     /**< Difference between the planned and actual start of the latest periodic timeslot. */
+    uint32_t period_jitter_max_us;                      /**< Largest such difference. */
+    uint32_t period_reanchors;                          /**< Times periodic mode fell back to an earliest request after too many lost timeslots. */
+    uint32_t escalations;                               /**< Times requests switched to high priority. */
+    uint32_t escalated_slots;                           /**< Timeslots granted at high priority. */
+    uint64_t escalated_time_us;                         /**< Radio time taken by those timeslots, extensions included. BLE events falling in it may be skipped. */
+    uint64_t active_time_us;                            /**< Radio time taken by all timeslots, extensions included. */
+    uint64_t session_time_us;                           /**< Time the radio session has been open. */
+    uint64_t idle_time_us;                              /**< Time the session spent without a timeslot requested, in on-demand mode. */
+    uint32_t idle_permille;                             /**< Share of the session time spent idle, i.e. the radio time saved by on-demand mode. */
+    uint32_t wakeups;                                   /**< Times an idle session was woken by data to send or an Rx window. */
+    uint32_t requests;                                  /**< Timeslots requested. Compare with blocked_cnt and canceled_cnt for the collision rate. */
+    uint32_t ble_placed_requests;                       /**< Requests placed between BLE connection events. */
+    uint32_t extend_failed_cnt;                         /**< Extensions refused, usually for BLE activity. */
+    uint32_t ext_requested;                             /**< Extensions requested. */
+    uint32_t ext_granted;                               /**< Extensions granted. */
+    uint32_t last_slot_ext_requested;                   /**< Extensions requested in the latest finished timeslot. */
+    uint32_t last_slot_ext_granted;                     /**< Extensions granted in the latest finished timeslot. */
+    uint32_t last_slot_ext_failed;                      /**< Extensions refused in the latest finished timeslot. */
+    uint32_t max_slot_ext_granted;                      /**< Most extensions granted in a single timeslot. */
+    uint32_t ble_interval_us;                           /**< BLE connection interval, 0 when not connected. */
+    uint32_t deadline_escalations;                      /**< Requests made at high priority because a deadline was close. */
+    uint32_t deadline_overrides;                        /**< Periodic or BLE-aware requests replaced by an earliest request to meet a deadline. */
+    uint32_t blocked_permille;                          /**< Running average of the share of earliest requests blocked. */
+    uint32_t earliest_timeout_us;                       /**< Timeout of the latest earliest request. */
+    uint32_t retry_delays;                              /**< Re-requests delayed because requests kept getting blocked. */
+    uint32_t start_delay_hist[ESB_TIMESLOT_START_HIST_LEN]; /**< Timeslots started from an earliest request, by time from the first request since the previous timeslot: below 2^n ms in bucket n, the last bucket also counts longer times. */
+    uint32_t start_delay_max_us;                        /**< Longest such time. */
+    uint32_t renewals;                                  /**< Timeslots ended early near the 128 second limit of a timeslot, to request a new one. */
+    uint32_t renew_gap_last_us;                         /**< Time from the latest renewal to the next timeslot. */
+    uint32_t renew_gap_max_us;                          /**< Longest such time. */
+    uint32_t outages;                                   /**< Times the session went idle unexpectedly and was closed. */
+    uint32_t recover_attempts;                          /**< Attempts to reopen it. */
+    uint32_t outage_last_us;                            /**< Time from the latest outage to the next timeslot. */
+    uint32_t outage_max_us;                             /**< Longest such time. */
+    uint32_t outage_total_us;                           /**< Total time without timeslots because of outages. */
+    uint32_t esb_inits;                                 /**< Timeslots that started with a full UESB initialization. */
+    uint32_t esb_resumes;                               /**< Timeslots that started by restoring the saved RADIO configuration. */
+    uint32_t esb_init_last_us;                          /**< Time taken by the latest full initialization. */
+    uint32_t esb_init_max_us;                           /**< Longest such time. */
+    uint32_t esb_resume_last_us;                        /**< Time taken by the latest restore. */
+    uint32_t esb_resume_max_us;                         /**< Longest such time. */
+    uint32_t first_tx_init_avg_us;                      /**< Running average of the time from the start of the timeslot to its first packet, after a full initialization. */
+    uint32_t first_tx_resume_avg_us;                    /**< The same, after a restore. */
+    uint32_t first_tx_last_us;                          /**< Time from the start of the latest timeslot with a packet to its first packet. */
+    uint32_t first_tx_max_us;                           /**< Longest such time. */
+    uint32_t tx_end_waits;                              /**< Timeslot ends that waited for the result of the packet in flight before stopping UESB. */
+    uint32_t tx_end_cuts;                               /**< Of those, the ones where the timeslot ended first and the packet had to be sent again. */
+    uint32_t pid_reuses;                                /**< Packets sent again after failing with the packet ID of the failed attempt. */
+} esb_timeslot_slot_stats_t;
+
+
+/**@brief Radio time utilization statistics.
+ *
+ * @details Shows how the radio time granted by the SoftDevice is used. Requests, blocked and
+ *          cancelled timeslots and extensions are counted in @ref esb_timeslot_slot_stats_t.
+ *          The time totals are 64 bits wide, 32 bits of microseconds wrap after 71 minutes.
+ */
+typedef struct
+{
+    uint32_t granted_slots;                             /**< Timeslots granted. */
+    uint64_t granted_time_us;                           /**< Radio time granted, extensions included. */
+    uint64_t tx_time_us;                                /**< Time spent transmitting, retransmits included. */
+    uint64_t ack_wait_time_us;                          /**< Time spent waiting for acknowledgements. */
+    uint64_t rx_time_us;                                /**< Time spent listening. */
+    uint64_t idle_time_us;                              /**< Time granted but spent neither transmitting, waiting nor listening. */
+    uint32_t used_permille;                             /**< Share of the granted time that was used. */
+    uint32_t last_slot_len_us;                          /**< Length of the latest finished timeslot, extensions included. */
+    uint32_t last_slot_tx_us;                           /**< Time it spent transmitting. */
+    uint32_t last_slot_ack_us;                          /**< Time it spent waiting for acknowledgements. */
+    uint32_t last_slot_rx_us;                           /**< Time it spent listening. */
+    uint32_t last_slot_idle_us;                         /**< Time it spent idle. */
+} esb_timeslot_util_stats_t;
+
+
+/**@brief Module statistics.
+ */
+typedef struct
+{
+    esb_timeslot_rx_stats_t    rx;
+    esb_timeslot_queue_stats_t tx[ESB_TIMESLOT_CLASS_COUNT];    /**< Per traffic class. */
+    esb_timeslot_pipe_stats_t  pipe[NRF_ESB_PIPE_COUNT];        /**< Per pipe. */
+    esb_timeslot_slot_stats_t  slot;
+    esb_timeslot_util_stats_t  util;
+} esb_timeslot_stats_t;
+
+
 /**@brief Radio event handler
 */
 void RADIO_timeslot_IRQHandler(void);
@@ -48,6 +228,9 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type);
 
 
 /**@brief Function for initializing.
+ *
+ * @details Received data is passed to evt_handler in main context through app_scheduler,
+ *          which must be initialized by the application.
  */
 uint32_t esb_timeslot_init(ut_data_handler_t evt_handler);
 
@@ -57,6 +240,98 @@ uint32_t esb_timeslot_init(ut_data_handler_t evt_handler);
 uint32_t esb_timeslot_sd_start(void);
 
 
+/**@brief Function for selecting periodic timeslots.
+ *
+ * @details Instead of asking for the earliest possible timeslot after each one, timeslots are
+ *          requested at a fixed distance from the start of the previous one. This bounds the
+ *          latency, at the cost of radio time when there is nothing to send. Timeslots and their
+ *          extensions are kept short enough to end before the next one. Takes effect from the
+ *          next request.
+ *
+ * @param[in] period_us Distance between timeslot starts, or 0 to request the earliest possible timeslot (default).
+ *
+ * @retval NRF_SUCCESS
+ * @retval NRF_ERROR_INVALID_PARAM  Period too short for a timeslot, or too long to skip lost ones.
+ */
+uint32_t esb_timeslot_periodic_set(uint32_t period_us);
+
+
+/**@brief Function for setting when timeslots are requested at high priority.
+ *
+ * @details Requests normally use NRF_RADIO_PRIORITY_NORMAL, so BLE activity goes first. When the
+ *          Tx backlog or the age of the oldest queued packet reaches its threshold, requests
+ *          switch to NRF_RADIO_PRIORITY_HIGH, which can make the SoftDevice skip BLE events. They
+ *          switch back once both are below half their thresholds.
+ *
+ * @param[in] depth_bytes Tx backlog threshold in bytes, 0 to ignore the backlog.
+ * @param[in] age_ms      Packet age threshold in ms, 0 to ignore the age.
+ *
+ * @retval NRF_SUCCESS
+ */
+uint32_t esb_timeslot_escalation_set(uint32_t depth_bytes, uint32_t age_ms);
+
+
+/**@brief Function for setting whether timeslots are extended just to listen for packets.
+ *
+ * @details Timeslots are extended while there is data to send. With nothing to send they end
+ *          after the requested length, and the radio listens until then, unless listening is
+ *          required. Extensions are never used for listening in on-demand mode. Off by default.
+ *
+ * @param[in] required Whether to keep extending timeslots with nothing to send.
+ */
+void esb_timeslot_rx_required_set(bool required);
+
+
+/**@brief Function for placing timeslots between BLE connection events.
+ *
+ * @details The connection interval and the time of connection events are learned from BLE
+ *          events. While they are known, and periodic mode is off, timeslots are requested with
+ *          normal requests in the gaps between connection events, and extensions stop short of
+ *          the next one. Otherwise earliest requests are used. Connection event timing is
+ *          only learned from events with traffic, so on an idle link it is given up after 30
+ *          seconds. Off by default.
+ *
+ * @param[in] enable Whether to place timeslots between BLE connection events.
+ */
+void esb_timeslot_ble_aware_set(bool enable);
+
+
+/**@brief Function for setting when to listen for packets.
+ *
+ * @details With nothing to send, the radio listens for the rest of every timeslot by default.
+ *          With an Rx schedule it only listens in windows of window_us every period_us, which
+ *          lowers the receive time at the cost of latency, see @ref esb_timeslot_rx_stats_t.
+ *          Windows only open inside timeslots. With sync set, windows are re-centered on each
+ *          received packet, so they follow a peer sending at the same period. Resets the
+ *          receive time statistics.
+ *
+ * @param[in] window_us Length of Rx windows.
+ * @param[in] period_us Distance between Rx window starts, or 0 to listen whenever there is nothing to send.
+ * @param[in] sync      Whether to follow the time packets are received.
+ *
+ * @retval NRF_SUCCESS
+ * @retval NRF_ERROR_INVALID_PARAM  Window too short or not shorter than the period, or period too long.
+ */
+uint32_t esb_timeslot_rx_schedule_set(uint32_t window_us, uint32_t period_us, bool sync);
+
+
+/**@brief Function for only requesting timeslots when there is something to do.
+ *
+ * @details In on-demand mode the session goes idle at the end of a timeslot when no data is
+ *          queued and no Rx window is due, instead of requesting the next one. Queuing data, or
+ *          the Rx window timer, wakes the session with an earliest request. Rx is only possible
+ *          while the radio is in a timeslot, so received packets may wait up to rx_interval_ms.
+ *          The app_timer module must be initialized first.
+ *
+ * @param[in] enable         Whether to use on-demand mode. It is off by default.
+ * @param[in] rx_interval_ms Interval between Rx windows in on-demand mode, or 0 for no Rx windows.
+ *
+ * @retval NRF_SUCCESS
+ * @return Any error from app_timer_stop() or app_timer_start().
+ */
+uint32_t esb_timeslot_on_demand_set(bool enable, uint32_t rx_interval_ms);
+
+
 /**@brief Function for stopping the timeslot API.
  */
 uint32_t esb_timeslot_sd_stop(void);
@@ -64,14 +339,103 @@ uint32_t esb_timeslot_sd_stop(void);
 
 /**@brief Send string via micro-ESB
  *
- * @note Function blocks until previous transmission has finished
- * @details String is put into internal buffer. Transmission will be started at the beginning of the next timeslot or timeslot extension.
- * @param[in] p_str  String
- * @param[in] length String length
+ * @note Function may be called from any interrupt priority, the internal buffer is lock-free.
+ * @details String is put into the buffer of its traffic class and pipe, split into several ESB payloads if it is longer than
+ *          NRF_ESB_MAX_PAYLOAD_LENGTH. Transmission will be started at the beginning of the next timeslot or timeslot extension.
+ *          Pipes are served in turn, so a pipe whose peer doesn't acknowledge does not hold up the others.
+ * @param[in] p_str    String
+ * @param[in] length   String length
+ * @param[in] pipe     Pipe to send on
+ * @param[in] tx_class Traffic class
  *
  * @retval NRF_SUCCESS
  * @retval NRF_ERROR_NO_MEM
+ * @retval NRF_ERROR_INVALID_PARAM   Invalid pipe or traffic class.
+ * @retval NRF_ERROR_INVALID_LENGTH  String does not fit in 8 ESB payloads, or never fits in the Tx FIFO of the traffic class.
+ *                                   Only ESB_TIMESLOT_CLASS_BULK takes strings of any length, ESB_TIMESLOT_CLASS_CONTROL
+ *                                   takes one full ESB payload and ESB_TIMESLOT_CLASS_TELEMETRY two.
+ */
+uint32_t esb_timeslot_send_str(uint8_t * p_str, uint32_t length, uint8_t pipe, esb_timeslot_class_t tx_class);
+
+
+/**@brief Send string via micro-ESB, to be delivered within a deadline.
+ *
+ * @note Function may be called from any interrupt priority.
+ * @details Works like @ref esb_timeslot_send_str. Until the message is delivered, timeslots are
+ *          requested to meet its deadline: periodic or BLE-aware requests that would start too
+ *          late are replaced by earliest requests, earliest requests time out in time to retry,
+ *          and requests are made at high priority when the deadline is close. Whether the
+ *          deadline was met is counted in @ref esb_timeslot_queue_stats_t.
+ * @param[in] p_str       String
+ * @param[in] length      String length
+ * @param[in] pipe        Pipe to send on
+ * @param[in] tx_class    Traffic class
+ * @param[in] deadline_ms Time from now the string must be delivered by, at most 60 seconds.
+ *
+ * @retval NRF_SUCCESS
+ * @retval NRF_ERROR_NO_MEM          No room in the Tx FIFO, or too many messages with a deadline queued.
+ * @retval NRF_ERROR_TIMEOUT         The Tx backlog can't be sent before the deadline.
+ * @retval NRF_ERROR_INVALID_PARAM   Invalid pipe, traffic class or deadline.
+ * @retval NRF_ERROR_INVALID_LENGTH  See @ref esb_timeslot_send_str.
+ */
+uint32_t esb_timeslot_send_deadline(uint8_t * p_str, uint32_t length, uint8_t pipe, esb_timeslot_class_t tx_class, uint32_t deadline_ms);
+
+
+/**@brief Send a single ESB payload tagged with a key.
+ *
+ * @details Works like @ref esb_timeslot_send_str. With @ref ESB_TIMESLOT_OVERFLOW_OVERWRITE_KEY
+ *          a full queue keeps only the latest value per key, e.g. for sensor readings where
+ *          old values are useless. Key 0 means no key.
+ *
+ * @param[in] p_data   Payload
+ * @param[in] length   Payload length, the same for all packets with the same key.
+ * @param[in] key      Key
+ * @param[in] pipe     Pipe to send on
+ * @param[in] tx_class Traffic class
+ *
+ * @retval NRF_SUCCESS
+ * @retval NRF_ERROR_NO_MEM
+ * @retval NRF_ERROR_INVALID_PARAM   Invalid pipe or traffic class.
+ * @retval NRF_ERROR_INVALID_LENGTH  Data does not fit in one ESB payload.
+ */
+uint32_t esb_timeslot_send_keyed(uint8_t * p_data, uint32_t length, uint8_t key, uint8_t pipe, esb_timeslot_class_t tx_class);
+
+
+/**@brief Set the share of the radio a traffic class gets.
+ *
+ * @details Whatever ESB_TIMESLOT_CLASS_CONTROL leaves is shared between the other classes in
+ *          proportion to their weights, counted in payload bytes.
+ *
+ * @param[in] tx_class Traffic class, not ESB_TIMESLOT_CLASS_CONTROL.
+ * @param[in] weight   Weight, at least 1.
+ *
+ * @retval NRF_SUCCESS
+ * @retval NRF_ERROR_INVALID_PARAM
+ */
+uint32_t esb_timeslot_class_weight_set(esb_timeslot_class_t tx_class, uint32_t weight);
+
+
+/**@brief Select what sending in a traffic class does when its transmit queue is full.
+ *
+ * @note ESB_TIMESLOT_OVERFLOW_BLOCK waits for the radio to empty the queue, so it must only be
+ *       used from main context or interrupt priorities lower than the timeslot handlers.
+ *
+ * @param[in] tx_class         Traffic class.
+ * @param[in] policy           Overflow policy.
+ * @param[in] block_timeout_ms Longest wait with ESB_TIMESLOT_OVERFLOW_BLOCK.
+ *
+ * @retval NRF_SUCCESS
+ * @retval NRF_ERROR_INVALID_PARAM
+ */
+uint32_t esb_timeslot_overflow_policy_set(esb_timeslot_class_t           tx_class,
+                                          esb_timeslot_overflow_policy_t policy,
+                                          uint32_t                       block_timeout_ms);
+
+
+/**@brief Get a snapshot of the module statistics.
+ *
+ * @param[out] p_stats  Statistics.
  */
-uint32_t esb_timeslot_send_str(uint8_t * p_str, uint32_t length);
+void esb_timeslot_stats_get(esb_timeslot_stats_t * p_stats);
 
 #endif  // TIMESLOT_H__
@@ -5,157 +5,539 @@
 #include <stdint.h>
 #include <string.h>
 
-#define FIFO_BUF_LEN 512
+/* Lock-free packet FIFO with any number of producers and a single consumer.
+ *
+ * Producers reserve space by advancing the claim index with a compare-and-swap, copy their
+ * data in, and then release the claim. The claim word also counts the producers that are
+ * still copying; the last one to finish publishes everything claimed so far to the consumer
+ * through commit_idx. Producers preempting each other therefore never wait on each other,
+ * and a packet is visible to the consumer only once it has been completely written.
+ *
+ * Each packet is stored as a record: a fifo_pkt_hdr_t followed by the payload bytes, padded to
+ * a whole word. Small packets therefore take little space. The header is larger than the padding,
+ * so headers can wrap around the end of the buffer like payloads, and are always copied in and
+ * out with fifo_hdr_read and fifo_hdr_write.
+ *
+ * Functions that read or remove packets, including fifo_overwrite_key, are consumer functions and
+ * must not run concurrently with each other.
+ *
+ * Indices are free running and reduced to a buffer offset with a mask. Instances are created
+ * with FIFO_DEF or FIFO_ARRAY_DEF, which give each FIFO its own storage and check at compile time
+ * that the size is a power of two.
+ *
+ * The header builds as both C and C++.
+ */
+
+#define FIFO_IDX_MASK           0x00FFFFFFUL            /**< Indices are 24 bits wide to fit in the claim word. */
+#define FIFO_CLAIM_IDX_Pos      8                       /**< Claimed write index. */
+#define FIFO_CLAIM_BUSY_Msk     0x000000FFUL            /**< Number of producers currently writing. */
+
+#ifdef __cplusplus
+#define FIFO_STATIC_ASSERT(cond, msg)       static_assert(cond, msg)
+#else
+#define FIFO_STATIC_ASSERT(cond, msg)       _Static_assert(cond, msg)
+#endif
+
+#define FIFO_ATOMIC_LOAD(p_var)             __atomic_load_n((p_var), __ATOMIC_ACQUIRE)
+#define FIFO_ATOMIC_STORE(p_var, val)       __atomic_store_n((p_var), (val), __ATOMIC_RELEASE)
+#define FIFO_ATOMIC_CAS(p_var, p_old, val)  __atomic_compare_exchange_n((p_var), (p_old), (val), true, \
+                                                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#define FIFO_IDX_DIFF(a, b)     (((a) - (b)) & FIFO_IDX_MASK)
 
 typedef struct
 {
-    uint8_t  buf[FIFO_BUF_LEN];
-    uint32_t start_idx;
-    uint32_t end_idx;
-    uint32_t free_items;
+    uint8_t  length;        /**< Number of payload bytes following the header. */
+    uint8_t  pipe;          /**< Pipe the packet is addressed to. */
+    uint8_t  key;           /**< Packets with the same non-zero key can replace each other, see fifo_overwrite_key. */
+    uint8_t  seq;           /**< Incremented each time the payload is replaced. */
+    uint32_t time;          /**< Time stamp given by the producer, e.g. when the packet was queued. */
+    uint32_t id;            /**< Identifier given by the producer, e.g. of the message the packet is part of. */
+} fifo_pkt_hdr_t;
+
+typedef struct
+{
+    uint8_t const * p_data;
+    uint32_t        len;
+} fifo_span_t;
+
+typedef struct
+{
+    uint32_t       idx;         /**< Index of the record in the FIFO. */
+    fifo_pkt_hdr_t hdr;
+    fifo_span_t    span[2];     /**< Payload in place. The second span is only used when the payload wraps. */
+    uint32_t       span_cnt;
+} fifo_pkt_view_t;
+
+typedef struct
+{
+    uint8_t * p_data;           /**< Payload. For fifo_get_many, the buffer to copy into. */
+    uint8_t   length;           /**< Payload length. For fifo_get_many, the size of p_data on input. */
+    uint8_t   pipe;
+    uint8_t   key;              /**< See fifo_pkt_hdr_t. */
+    uint32_t  time;             /**< See fifo_pkt_hdr_t. */
+    uint32_t  id;               /**< See fifo_pkt_hdr_t. */
+} fifo_pkt_t;
+
+#define FIFO_PKT_MAX_LEN        UINT8_MAX
+#define FIFO_PKT_REC_LEN(len)   ((sizeof(fifo_pkt_hdr_t) + (len) + 3UL) & ~3UL)   /**< Bytes taken by a packet record. */
+
+typedef struct
+{
+    uint8_t * p_buf;        /**< Word-aligned storage. */
+    uint32_t buf_mask;      /**< Size of the storage minus one. */
+    uint32_t claim;         /**< Claimed write index and number of busy producers, see FIFO_CLAIM_*. */
+    uint32_t commit_idx;    /**< Write index up to which data is visible to the consumer. */
+    uint32_t start_idx;     /**< Read index. Only written by the consumer. */
+    uint32_t max_used;      /**< High-water mark of claimed bytes. */
 } fifo_t;
 
+#define FIFO_SIZE(p_fifo)       ((p_fifo)->buf_mask + 1)
+
+#define FIFO_SIZE_CHECK(size)                                                                   \
+    FIFO_STATIC_ASSERT((((size) & ((size) - 1)) == 0) && ((size) >= 4) &&                       \
+                       ((size) <= (FIFO_IDX_MASK >> 1)),                                        \
+                       "FIFO size must be a power of two between 4 and 2^23")
+
+/**@brief Macro for defining a FIFO instance with its own storage.
+ *
+ * @param name  Name of the fifo_t instance.
+ * @param size  Size of the storage in bytes. Must be a power of two between 4 and 2^23.
+ */
+#define FIFO_DEF(name, size)                                                                    \
+    FIFO_SIZE_CHECK(size);                                                                      \
+    static uint32_t name##_buf[(size) / sizeof(uint32_t)];                                      \
+    static fifo_t name = { (uint8_t *)name##_buf, (size) - 1, 0, 0, 0, 0 }
+
+/**@brief Macro for defining an array of FIFO instances, each with its own storage.
+ *
+ * @details The instances must be set up with FIFO_ARRAY_INIT before use.
+ *
+ * @param name   Name of the fifo_t array.
+ * @param count  Number of instances.
+ * @param size   Size of the storage of each instance, see FIFO_DEF.
+ */
+#define FIFO_ARRAY_DEF(name, count, size)                                                       \
+    FIFO_SIZE_CHECK(size);                                                                      \
+    static uint32_t name##_buf[count][(size) / sizeof(uint32_t)];                               \
+    static fifo_t name[count]
+
+/**@brief Macro for pointing the instances of a FIFO_ARRAY_DEF array at their storage and emptying them. */
+#define FIFO_ARRAY_INIT(name)                                                                   \
+    do                                                                                          \
+    {                                                                                           \
+        for (uint32_t name##_i = 0; name##_i < sizeof(name) / sizeof(name[0]); name##_i++)     \
+        {                                                                                       \
+            name[name##_i].p_buf    = (uint8_t *)name##_buf[name##_i];                          \
+            name[name##_i].buf_mask = sizeof(name##_buf[0]) - 1;                                \
+            fifo_init(&name[name##_i]);                                                         \
+        }                                                                                       \
+    } while (0)
+
+/* Empties the FIFO and clears its statistics. */
 static inline void fifo_init(fifo_t * p_fifo)
 {
-    memset(p_fifo, 0, sizeof(fifo_t));
-    p_fifo->free_items = FIFO_BUF_LEN;
+    p_fifo->claim      = 0;
+    p_fifo->commit_idx = 0;
+    p_fifo->start_idx  = 0;
+    p_fifo->max_used   = 0;
 }
 
+/* Number of bytes taken by committed packet records. */
 static inline uint32_t fifo_num_elem_get(fifo_t * p_fifo)
 {
-    return (FIFO_BUF_LEN - p_fifo->free_items);
+    return FIFO_IDX_DIFF(FIFO_ATOMIC_LOAD(&p_fifo->commit_idx), p_fifo->start_idx);
 }
 
-static inline void fifo_get_pkt(fifo_t * p_fifo, uint8_t * p_buf, uint32_t * p_buf_len)
+/* Raises *p_var to val unless it is already larger. */
+static inline void fifo_atomic_max(uint32_t * p_var, uint32_t val)
 {
-    uint32_t num_items;
-    
-    if (p_fifo->free_items == sizeof(p_fifo->buf))
+    uint32_t old = FIFO_ATOMIC_LOAD(p_var);
+
+    while (old < val && !FIFO_ATOMIC_CAS(p_var, &old, val))
+    {
+    }
+}
+
+/* Reserves len bytes for the calling producer. On success *p_idx is the first reserved index. */
+static inline bool fifo_claim(fifo_t * p_fifo, uint32_t len, uint32_t * p_idx)
+{
+    uint32_t claim = FIFO_ATOMIC_LOAD(&p_fifo->claim);
+    uint32_t end_idx;
+    uint32_t used;
+
+    do
+    {
+        end_idx = claim >> FIFO_CLAIM_IDX_Pos;
+        used    = FIFO_IDX_DIFF(end_idx, FIFO_ATOMIC_LOAD(&p_fifo->start_idx));
+
+        if ((FIFO_SIZE(p_fifo) - used) < len || (claim & FIFO_CLAIM_BUSY_Msk) == FIFO_CLAIM_BUSY_Msk)
+        {
+            return false;
+        }
+    } while (!FIFO_ATOMIC_CAS(&p_fifo->claim,
+                              &claim,
+                              (((end_idx + len) & FIFO_IDX_MASK) << FIFO_CLAIM_IDX_Pos) | ((claim & FIFO_CLAIM_BUSY_Msk) + 1)));
+
+    fifo_atomic_max(&p_fifo->max_used, used + len);
+
+    *p_idx = end_idx;
+    return true;
+}
+
+/* Releases a claim once its data is written. The last busy producer publishes all claimed data. */
+static inline void fifo_commit(fifo_t * p_fifo)
+{
+    uint32_t claim = FIFO_ATOMIC_LOAD(&p_fifo->claim);
+    uint32_t end_idx;
+    uint32_t commit_idx;
+
+    while (!FIFO_ATOMIC_CAS(&p_fifo->claim, &claim, claim - 1))
+    {
+    }
+
+    if (((claim - 1) & FIFO_CLAIM_BUSY_Msk) != 0)
     {
-        *p_buf_len = 0;
         return;
     }
-    
-    if (p_fifo->start_idx < p_fifo->end_idx)
+
+    // Never move commit_idx backwards if a later producer has already published past us
+    end_idx    = claim >> FIFO_CLAIM_IDX_Pos;
+    commit_idx = FIFO_ATOMIC_LOAD(&p_fifo->commit_idx);
+    while (FIFO_IDX_DIFF(end_idx, commit_idx) != 0 &&
+           FIFO_IDX_DIFF(end_idx, commit_idx) <= FIFO_SIZE(p_fifo))
     {
-        num_items = p_fifo->end_idx - p_fifo->start_idx;
+        if (FIFO_ATOMIC_CAS(&p_fifo->commit_idx, &commit_idx, end_idx))
+        {
+            break;
+        }
     }
-    else
+}
+
+/* Copies len bytes into the buffer starting at index idx, in at most two bulk copies. */
+static inline void fifo_copy_in(fifo_t * p_fifo, uint32_t idx, uint8_t const * p_buf, uint32_t len)
+{
+    uint32_t offset = idx & p_fifo->buf_mask;
+
+    if (offset + len > FIFO_SIZE(p_fifo))
     {
-        num_items = p_fifo->end_idx + (sizeof(p_fifo->buf) - p_fifo->start_idx);
+        uint32_t bytes_to_copy;
+
+        // Wrap around
+        bytes_to_copy = FIFO_SIZE(p_fifo) - offset;
+
+        memcpy(&p_fifo->p_buf[offset], p_buf, bytes_to_copy);
+        memcpy(&p_fifo->p_buf[0], p_buf + bytes_to_copy, len - bytes_to_copy);
     }
-    
-    // Truncating elements to get from fifo
-    if (num_items > *p_buf_len)
+    else
     {
-        num_items = *p_buf_len;
+        memcpy(&p_fifo->p_buf[offset], p_buf, len);
     }
-    
-    *p_buf_len = num_items;
-    
-    if (p_fifo->start_idx + num_items > sizeof(p_fifo->buf))
+}
+
+/* Copies len bytes out of the buffer starting at index idx. */
+static inline void fifo_copy_out(fifo_t * p_fifo, uint32_t idx, uint8_t * p_buf, uint32_t len)
+{
+    uint32_t offset = idx & p_fifo->buf_mask;
+
+    if (offset + len > FIFO_SIZE(p_fifo))
     {
         uint32_t bytes_to_copy;
-        
+
         // Wrap around
-        bytes_to_copy = sizeof(p_fifo->buf) - p_fifo->start_idx;
-        
-        memcpy(p_buf, &p_fifo->buf[p_fifo->start_idx], bytes_to_copy);
-        p_buf                  += bytes_to_copy;
-        p_fifo->free_items += bytes_to_copy;
-        p_fifo->start_idx   = 0;
-        num_items              -= bytes_to_copy;
+        bytes_to_copy = FIFO_SIZE(p_fifo) - offset;
+
+        memcpy(p_buf, &p_fifo->p_buf[offset], bytes_to_copy);
+        memcpy(p_buf + bytes_to_copy, &p_fifo->p_buf[0], len - bytes_to_copy);
     }
-    
-    memcpy(p_buf, &p_fifo->buf[p_fifo->start_idx], num_items);
-    p_fifo->start_idx  += num_items;
-    p_fifo->free_items += num_items;
+    else
+    {
+        memcpy(p_buf, &p_fifo->p_buf[offset], len);
+    }
+}
+
+/* Reads the header of the record at index idx. */
+static inline void fifo_hdr_read(fifo_t * p_fifo, uint32_t idx, fifo_pkt_hdr_t * p_hdr)
+{
+    fifo_copy_out(p_fifo, idx, (uint8_t *)p_hdr, sizeof(fifo_pkt_hdr_t));
+}
+
+/* Writes the header of the record at index idx. */
+static inline void fifo_hdr_write(fifo_t * p_fifo, uint32_t idx, fifo_pkt_hdr_t const * p_hdr)
+{
+    fifo_copy_in(p_fifo, idx, (uint8_t const *)p_hdr, sizeof(fifo_pkt_hdr_t));
+}
+
+/* Reads the header of the oldest packet. Returns false if the FIFO is empty. */
+static inline bool fifo_peek_hdr(fifo_t * p_fifo, fifo_pkt_hdr_t * p_hdr)
+{
+    if (fifo_num_elem_get(p_fifo) == 0)
+    {
+        return false;
+    }
+
+    fifo_hdr_read(p_fifo, p_fifo->start_idx, p_hdr);
+
+    return true;
 }
 
-static inline void fifo_peek_pkt(fifo_t * p_fifo, uint8_t * p_buf, uint32_t * p_buf_len)
+/* Copies the oldest packet without removing it. *p_buf_len is the size of p_buf on input and the
+ * number of bytes copied on output; packets longer than p_buf are truncated. */
+static inline bool fifo_peek_pkt(fifo_t * p_fifo, uint8_t * p_pipe, uint8_t * p_buf, uint32_t * p_buf_len)
 {
-    uint32_t num_items, start_idx;
-    
-    if (p_fifo->free_items == sizeof(p_fifo->buf))
+    fifo_pkt_hdr_t hdr;
+
+    if (!fifo_peek_hdr(p_fifo, &hdr))
     {
         *p_buf_len = 0;
-        return;
+        return false;
     }
-    
-    start_idx  = p_fifo->start_idx;
-    
-    if (p_fifo->start_idx < p_fifo->end_idx)
+
+    // Truncating elements to get from fifo
+    if (hdr.length < *p_buf_len)
     {
-        num_items = p_fifo->end_idx - p_fifo->start_idx;
+        *p_buf_len = hdr.length;
     }
-    else
+
+    *p_pipe = hdr.pipe;
+    fifo_copy_out(p_fifo, p_fifo->start_idx + sizeof(fifo_pkt_hdr_t), p_buf, *p_buf_len);
+
+    return true;
+}
+
+/* Copies and removes the oldest packet, see fifo_peek_pkt. */
+static inline bool fifo_get_pkt(fifo_t * p_fifo, uint8_t * p_pipe, uint8_t * p_buf, uint32_t * p_buf_len)
+{
+    fifo_pkt_hdr_t hdr;
+
+    if (!fifo_peek_hdr(p_fifo, &hdr))
     {
-        num_items = p_fifo->end_idx + (sizeof(p_fifo->buf) - p_fifo->start_idx);
+        *p_buf_len = 0;
+        return false;
     }
-    
-    // Truncating elements to get from fifo
-    if (num_items > *p_buf_len)
+
+    (void)fifo_peek_pkt(p_fifo, p_pipe, p_buf, p_buf_len);
+
+    FIFO_ATOMIC_STORE(&p_fifo->start_idx, (p_fifo->start_idx + FIFO_PKT_REC_LEN(hdr.length)) & FIFO_IDX_MASK);
+
+    return true;
+}
+
+/* Describes the oldest packet without copying it. The spans point into the FIFO and stay valid
+ * until the packet is consumed. */
+static inline bool fifo_peek_view(fifo_t * p_fifo, fifo_pkt_view_t * p_view)
+{
+    uint32_t offset;
+
+    if (!fifo_peek_hdr(p_fifo, &p_view->hdr))
     {
-        num_items = *p_buf_len;
+        p_view->span_cnt = 0;
+        return false;
     }
-    
-    *p_buf_len = num_items;
-    
-    if (start_idx + num_items > sizeof(p_fifo->buf))
+
+    p_view->idx = p_fifo->start_idx;
+    offset      = (p_view->idx + sizeof(fifo_pkt_hdr_t)) & p_fifo->buf_mask;
+
+    p_view->span[0].p_data = &p_fifo->p_buf[offset];
+    p_view->span[0].len    = p_view->hdr.length;
+    p_view->span_cnt       = 1;
+
+    if (offset + p_view->hdr.length > FIFO_SIZE(p_fifo))
     {
-        uint32_t bytes_to_copy;
-        
         // Wrap around
-        bytes_to_copy = sizeof(p_fifo->buf) - start_idx;
-        
-        memcpy(p_buf, &p_fifo->buf[start_idx], bytes_to_copy);
-        p_buf      += bytes_to_copy;
-        start_idx   = 0;
-        num_items  -= bytes_to_copy;
+        p_view->span[0].len    = FIFO_SIZE(p_fifo) - offset;
+        p_view->span[1].p_data = &p_fifo->p_buf[0];
+        p_view->span[1].len    = p_view->hdr.length - p_view->span[0].len;
+        p_view->span_cnt       = 2;
+    }
+
+    return true;
+}
+
+/* Removes up to num_pkts of the oldest packets without copying them. Returns the number removed. */
+static inline uint32_t fifo_consume(fifo_t * p_fifo, uint32_t num_pkts)
+{
+    uint32_t       start_idx = p_fifo->start_idx;
+    uint32_t       avail     = fifo_num_elem_get(p_fifo);
+    uint32_t       consumed  = 0;
+    fifo_pkt_hdr_t hdr;
+
+    while (consumed < num_pkts && avail > 0)
+    {
+        fifo_hdr_read(p_fifo, start_idx, &hdr);
+
+        start_idx += FIFO_PKT_REC_LEN(hdr.length);
+        avail     -= FIFO_PKT_REC_LEN(hdr.length);
+        consumed  += 1;
+    }
+
+    FIFO_ATOMIC_STORE(&p_fifo->start_idx, start_idx & FIFO_IDX_MASK);
+
+    return consumed;
+}
+
+/* Removes the packet described by p_view, unless it has since been removed or replaced by
+ * fifo_overwrite_key. Returns whether it was removed. */
+static inline bool fifo_consume_view(fifo_t * p_fifo, fifo_pkt_view_t const * p_view)
+{
+    fifo_pkt_hdr_t hdr;
+
+    if (!fifo_peek_hdr(p_fifo, &hdr) ||
+        p_fifo->start_idx != p_view->idx ||
+        memcmp(&hdr, &p_view->hdr, sizeof(hdr)) != 0)
+    {
+        return false;
     }
-    
-    memcpy(p_buf, &p_fifo->buf[start_idx], num_items);
+
+    return (fifo_consume(p_fifo, 1) == 1);
 }
 
-static inline bool fifo_put_pkt(fifo_t * p_fifo, uint8_t * p_buf, uint32_t p_buf_len)
+/* Replaces the payload of the newest queued packet with the given key, if the new payload rounds up
+ * to the same record size. Returns whether a packet was replaced.
+ *
+ * Like the consumer functions, this must not run concurrently with the consumer. */
+static inline bool fifo_overwrite_key(fifo_t * p_fifo, uint8_t key, uint8_t const * p_buf, uint32_t p_buf_len)
 {
-    if (p_fifo->free_items < p_buf_len)
+    uint32_t       idx   = p_fifo->start_idx;
+    uint32_t       avail = fifo_num_elem_get(p_fifo);
+    uint32_t       found = 0;
+    bool           match = false;
+    fifo_pkt_hdr_t hdr;
+
+    if (key == 0)
     {
         return false;
     }
-    
-    for (int i = 0; i < p_buf_len; ++i)
+
+    while (avail > 0)
     {
-        p_fifo->buf[p_fifo->end_idx] = p_buf[i];
-        ++p_fifo->end_idx;
-        if (p_fifo->end_idx == sizeof(p_fifo->buf))
+        fifo_hdr_read(p_fifo, idx, &hdr);
+
+        if (hdr.key == key)
         {
-            p_fifo->end_idx = 0;
+            found = idx;
+            match = true;
         }
+
+        idx   += FIFO_PKT_REC_LEN(hdr.length);
+        avail -= FIFO_PKT_REC_LEN(hdr.length);
+    }
+
+    if (!match)
+    {
+        return false;
     }
-    
-    p_fifo->free_items -= p_buf_len;
-    
+
+    fifo_hdr_read(p_fifo, found, &hdr);
+
+    if (FIFO_PKT_REC_LEN(p_buf_len) != FIFO_PKT_REC_LEN(hdr.length))
+    {
+        return false;
+    }
+
+    hdr.length = (uint8_t)p_buf_len;
+    hdr.seq   += 1;
+
+    fifo_copy_in(p_fifo, found + sizeof(hdr), p_buf, p_buf_len);
+    fifo_hdr_write(p_fifo, found, &hdr);
+
     return true;
 }
 
-static inline bool fifo_put_char(fifo_t * p_fifo, uint8_t p_char)
+/* Copies up to num_pkts of the oldest packets out and removes them with a single index update.
+ * For each descriptor, length is the size of p_data on input and the number of bytes copied on
+ * output. Returns the number of packets removed. */
+static inline uint32_t fifo_get_many(fifo_t * p_fifo, fifo_pkt_t * p_pkts, uint32_t num_pkts)
 {
-    if (p_fifo->free_items == 0)
+    uint32_t       start_idx = p_fifo->start_idx;
+    uint32_t       avail     = fifo_num_elem_get(p_fifo);
+    uint32_t       got       = 0;
+    fifo_pkt_hdr_t hdr;
+
+    while (got < num_pkts && avail > 0)
+    {
+        fifo_hdr_read(p_fifo, start_idx, &hdr);
+
+        // Truncating elements to get from fifo
+        if (hdr.length < p_pkts[got].length)
+        {
+            p_pkts[got].length = hdr.length;
+        }
+        p_pkts[got].pipe = hdr.pipe;
+        p_pkts[got].key  = hdr.key;
+        p_pkts[got].time = hdr.time;
+        p_pkts[got].id   = hdr.id;
+        fifo_copy_out(p_fifo, start_idx + sizeof(hdr), p_pkts[got].p_data, p_pkts[got].length);
+
+        start_idx += FIFO_PKT_REC_LEN(hdr.length);
+        avail     -= FIFO_PKT_REC_LEN(hdr.length);
+        got       += 1;
+    }
+
+    FIFO_ATOMIC_STORE(&p_fifo->start_idx, start_idx & FIFO_IDX_MASK);
+
+    return got;
+}
+
+/* Queues several packets under a single claim, so they are stored back to back and become visible
+ * together. Either all packets are queued or none. Safe to call concurrently from any number of
+ * contexts. */
+static inline bool fifo_put_many(fifo_t * p_fifo, fifo_pkt_t const * p_pkts, uint32_t num_pkts)
+{
+    fifo_pkt_hdr_t hdr;
+    uint32_t       total_len = 0;
+    uint32_t       end_idx;
+
+    for (uint32_t i = 0; i < num_pkts; i++)
+    {
+        total_len += FIFO_PKT_REC_LEN(p_pkts[i].length);
+    }
+
+    if (!fifo_claim(p_fifo, total_len, &end_idx))
     {
         return false;
     }
-    
-    p_fifo->buf[p_fifo->end_idx++] = p_char;
-    
-    if (p_fifo->end_idx == sizeof(p_fifo->buf))
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    for (uint32_t i = 0; i < num_pkts; i++)
     {
-        p_fifo->end_idx = 0;
+        hdr.length = p_pkts[i].length;
+        hdr.pipe   = p_pkts[i].pipe;
+        hdr.key    = p_pkts[i].key;
+        hdr.time   = p_pkts[i].time;
+        hdr.id     = p_pkts[i].id;
+
+        fifo_hdr_write(p_fifo, end_idx, &hdr);
+        fifo_copy_in(p_fifo, end_idx + sizeof(hdr), p_pkts[i].p_data, p_pkts[i].length);
+
+        end_idx += FIFO_PKT_REC_LEN(p_pkts[i].length);
     }
-    
-    p_fifo->free_items -= 1;
-    
+
+    fifo_commit(p_fifo);
+
     return true;
 }
 
+/* Safe to call concurrently from any number of contexts. Only the header and the payload bytes
+ * are stored, rounded up to a whole word. */
+static inline bool fifo_put_pkt(fifo_t * p_fifo, uint8_t pipe, uint8_t const * p_buf, uint32_t p_buf_len)
+{
+    fifo_pkt_t pkt;
+
+    if (p_buf_len > FIFO_PKT_MAX_LEN)
+    {
+        return false;
+    }
+
+    pkt.p_data = (uint8_t *)p_buf;
+    pkt.length = (uint8_t)p_buf_len;
+    pkt.pipe   = pipe;
+    pkt.key    = 0;
+    pkt.time   = 0;
+    pkt.id     = 0;
+
+    return fifo_put_many(p_fifo, &pkt, 1);
+}
+
 #endif /* __fifo_h__ */
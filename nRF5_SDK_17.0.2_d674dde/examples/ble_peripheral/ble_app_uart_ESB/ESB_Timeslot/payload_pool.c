@@ -0,0 +1,66 @@
+#include "payload_pool.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdk_common.h"
+#include "app_util_platform.h"
+#include "nrf_balloc.h"
+
+
+NRF_BALLOC_DEF(m_payload_pool, sizeof(payload_buf_t), PAYLOAD_POOL_BUF_COUNT);     /**< Buffer storage. */
+static nrf_atomic_u32_t m_in_use;                   /**< Number of buffers currently taken from the pool. */
+static uint32_t         m_max_used;                 /**< High-water mark of m_in_use. Updated in a critical region, buffers are taken at any priority. */
+
+
+uint32_t payload_pool_init(void)
+{
+    m_in_use   = 0;
+    m_max_used = 0;
+
+    return nrf_balloc_init(&m_payload_pool);
+}
+
+
+payload_buf_t * payload_pool_alloc(void)
+{
+    payload_buf_t * p_buf = nrf_balloc_alloc(&m_payload_pool);
+    uint32_t        in_use;
+
+    if (p_buf == NULL)
+    {
+        return NULL;
+    }
+
+    in_use = nrf_atomic_u32_add(&m_in_use, 1);
+
+    CRITICAL_REGION_ENTER();
+    m_max_used = MAX(m_max_used, in_use);
+    CRITICAL_REGION_EXIT();
+
+    p_buf->ref_cnt = 1;
+    p_buf->length  = 0;
+
+    return p_buf;
+}
+
+
+void payload_buf_ref(payload_buf_t * p_buf)
+{
+    (void)nrf_atomic_u32_add(&p_buf->ref_cnt, 1);
+}
+
+
+void payload_buf_release(payload_buf_t * p_buf)
+{
+    if (nrf_atomic_u32_sub(&p_buf->ref_cnt, 1) == 0)
+    {
+        (void)nrf_atomic_u32_sub(&m_in_use, 1);
+        nrf_balloc_free(&m_payload_pool, p_buf);
+    }
+}
+
+
+uint32_t payload_pool_max_used_get(void)
+{
+    return m_max_used;
+}
@@ -0,0 +1,62 @@
+#ifndef PAYLOAD_POOL_H__
+#define PAYLOAD_POOL_H__
+
+#include <stdint.h>
+
+#include "nrf_atomic.h"
+
+
+#ifndef PAYLOAD_POOL_BUF_SIZE
+#define PAYLOAD_POOL_BUF_SIZE       244     /**< Size of the data in each buffer, one BLE NUS packet at the largest ATT MTU. */
+#endif
+
+#ifndef PAYLOAD_POOL_BUF_COUNT
+#define PAYLOAD_POOL_BUF_COUNT      8       /**< Number of buffers in the pool. */
+#endif
+
+
+/**@brief Reference-counted buffer, shared by everything that sends the same data.
+ */
+typedef struct
+{
+    nrf_atomic_u32_t ref_cnt;                       /**< Number of holders. The buffer goes back to the pool when it drops to zero. */
+    uint16_t         length;                        /**< Number of valid bytes in data. */
+    uint8_t          data[PAYLOAD_POOL_BUF_SIZE];
+} payload_buf_t;
+
+
+/**@brief Function for initializing the pool.
+ */
+uint32_t payload_pool_init(void);
+
+
+/**@brief Take a buffer from the pool.
+ *
+ * @note May be called from any interrupt priority.
+ *
+ * @return Buffer with one reference held by the caller, or NULL if the pool is empty.
+ */
+payload_buf_t * payload_pool_alloc(void);
+
+
+/**@brief Add a reference, e.g. before handing the buffer to another transport.
+ *
+ * @param[in] p_buf Buffer
+ */
+void payload_buf_ref(payload_buf_t * p_buf);
+
+
+/**@brief Drop a reference. The last one returns the buffer to the pool.
+ *
+ * @note May be called from any interrupt priority.
+ *
+ * @param[in] p_buf Buffer
+ */
+void payload_buf_release(payload_buf_t * p_buf);
+
+
+/**@brief Get the highest number of buffers that have been in use at the same time.
+ */
+uint32_t payload_pool_max_used_get(void);
+
+#endif  // PAYLOAD_POOL_H__
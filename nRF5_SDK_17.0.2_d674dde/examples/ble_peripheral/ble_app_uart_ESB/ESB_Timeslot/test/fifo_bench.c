@@ -0,0 +1,420 @@
+/* Host benchmarks for fifo.h.
+ *
+ * Compares the packet record FIFO with the FIFO it replaced, which stored a whole
+ * nrf_esb_payload_t per packet and copied it in byte by byte. The legacy FIFO is reproduced here
+ * so both run on the same host.
+ *
+ * Build and run with "make bench". Times are host times and only meaningful relative to each
+ * other.
+ */
+
+#define _POSIX_C_SOURCE 199309L     /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES()          __rdtsc()
+#endif
+
+#include "fifo.h"
+
+#define BENCH_FIFO_SIZE         512                     /**< Size of the Tx FIFO the record format replaced. */
+#define BENCH_ITERATIONS        200000
+#define ESB_MAX_PAYLOAD_LENGTH  32                      /**< NRF_ESB_MAX_PAYLOAD_LENGTH of the nrf_esb default configuration. */
+#define BENCH_BATCH             4                       /**< Packets per fifo_put_many/fifo_get_many call. */
+
+/* nrf_esb_payload_t as stored by the legacy FIFO. */
+typedef struct
+{
+    uint8_t length;
+    uint8_t pipe;
+    int8_t  rssi;
+    uint8_t noack;
+    uint8_t pid;
+    uint8_t data[ESB_MAX_PAYLOAD_LENGTH];
+} legacy_payload_t;
+
+/* The legacy FIFO: a byte ring without packet boundaries. */
+typedef struct
+{
+    uint8_t  buf[BENCH_FIFO_SIZE];
+    uint32_t start_idx;
+    uint32_t end_idx;
+    uint32_t free_items;
+} legacy_fifo_t;
+
+FIFO_DEF(m_fifo, BENCH_FIFO_SIZE);
+
+static legacy_fifo_t m_legacy_fifo;
+
+static uint32_t const m_sizes[] = { 1, 2, 4, 8, 16, 32 };
+static uint32_t const m_copy_sizes[] = { 1, 8, 32, 64, 128, 252 };
+static uint32_t const m_wrap_offsets[] = { 0, 4, 16, 64 };     /**< Bytes before the end of the buffer the copy starts at, 0 for no wrap. */
+
+/* Keeps the compiler from optimizing the copies away. */
+static volatile uint32_t m_sink;
+
+
+static void legacy_fifo_init(legacy_fifo_t * p_fifo)
+{
+    memset(p_fifo, 0, sizeof(legacy_fifo_t));
+    p_fifo->free_items = BENCH_FIFO_SIZE;
+}
+
+
+static bool legacy_fifo_put_pkt(legacy_fifo_t * p_fifo, uint8_t const * p_buf, uint32_t p_buf_len)
+{
+    if (p_fifo->free_items < p_buf_len)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < p_buf_len; ++i)
+    {
+        p_fifo->buf[p_fifo->end_idx] = p_buf[i];
+        ++p_fifo->end_idx;
+        if (p_fifo->end_idx == sizeof(p_fifo->buf))
+        {
+            p_fifo->end_idx = 0;
+        }
+    }
+
+    p_fifo->free_items -= p_buf_len;
+
+    return true;
+}
+
+
+static void legacy_fifo_get_pkt(legacy_fifo_t * p_fifo, uint8_t * p_buf, uint32_t len)
+{
+    uint32_t bytes_to_copy = len;
+
+    if (p_fifo->start_idx + len > sizeof(p_fifo->buf))
+    {
+        // Wrap around
+        bytes_to_copy = sizeof(p_fifo->buf) - p_fifo->start_idx;
+
+        memcpy(p_buf, &p_fifo->buf[p_fifo->start_idx], bytes_to_copy);
+        p_fifo->start_idx = 0;
+        p_buf            += bytes_to_copy;
+        bytes_to_copy     = len - bytes_to_copy;
+    }
+
+    memcpy(p_buf, &p_fifo->buf[p_fifo->start_idx], bytes_to_copy);
+    p_fifo->start_idx  += bytes_to_copy;
+    p_fifo->free_items += len;
+}
+
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+static uint64_t cycles(void)
+{
+#ifdef BENCH_CYCLES
+    return BENCH_CYCLES();
+#else
+    return 0;
+#endif
+}
+
+
+/* Empties the FIFO with all indices at idx, so the next record starts there. */
+static void fifo_idx_set(fifo_t * p_fifo, uint32_t idx)
+{
+    fifo_init(p_fifo);
+    p_fifo->claim      = idx << FIFO_CLAIM_IDX_Pos;
+    p_fifo->commit_idx = idx;
+    p_fifo->start_idx  = idx;
+}
+
+
+/* Packets of each payload size that fit in the queue, and the cost of queueing and taking out one. */
+static void bench_records(void)
+{
+    legacy_payload_t payload;
+    uint8_t          out[FIFO_PKT_MAX_LEN];
+    uint8_t          pipe;
+    uint32_t         len;
+    uint32_t         depth;
+    uint64_t         start;
+    double           legacy_ns;
+    double           record_ns;
+
+    memset(&payload, 0x5A, sizeof(payload));
+
+    printf("Queue depth and copy cost per payload size, %u byte FIFO\n", BENCH_FIFO_SIZE);
+    printf("%8s %14s %14s %14s %14s\n", "payload", "legacy pkts", "record pkts", "legacy ns/pkt", "record ns/pkt");
+
+    for (uint32_t s = 0; s < sizeof(m_sizes) / sizeof(m_sizes[0]); s++)
+    {
+        payload.length = (uint8_t)m_sizes[s];
+
+        fifo_init(&m_fifo);
+        depth = 0;
+        while (fifo_put_pkt(&m_fifo, 0, payload.data, payload.length))
+        {
+            depth++;
+        }
+
+        legacy_fifo_init(&m_legacy_fifo);
+        start = time_ns();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            (void)legacy_fifo_put_pkt(&m_legacy_fifo, (uint8_t const *)&payload, sizeof(payload));
+            legacy_fifo_get_pkt(&m_legacy_fifo, out, sizeof(payload));
+            m_sink += out[0];
+        }
+        legacy_ns = (double)(time_ns() - start) / BENCH_ITERATIONS;
+
+        fifo_init(&m_fifo);
+        start = time_ns();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            (void)fifo_put_pkt(&m_fifo, 0, payload.data, payload.length);
+            len = sizeof(out);
+            (void)fifo_get_pkt(&m_fifo, &pipe, out, &len);
+            m_sink += out[0];
+        }
+        record_ns = (double)(time_ns() - start) / BENCH_ITERATIONS;
+
+        printf("%8u %14u %14u %14.1f %14.1f\n",
+               m_sizes[s],
+               (uint32_t)(BENCH_FIFO_SIZE / sizeof(legacy_payload_t)),
+               depth,
+               legacy_ns,
+               record_ns);
+    }
+    printf("\n");
+}
+
+
+/* Bytes copied and time taken per delivered packet on the Tx path. Before, the packet was copied
+ * out with fifo_peek_pkt to be sent and again with fifo_get_pkt once delivered. Now it is read in
+ * place with fifo_peek_view and removed with fifo_consume_view. Both paths end with the payload in
+ * the nrf_esb payload handed to UESB. */
+static void bench_zero_copy(void)
+{
+    legacy_payload_t tx_payload;
+    uint8_t          data[ESB_MAX_PAYLOAD_LENGTH];
+    uint8_t          scratch[ESB_MAX_PAYLOAD_LENGTH];
+    uint8_t          pipe;
+    uint32_t         len;
+    fifo_pkt_view_t  view;
+    uint64_t         copy_bytes;
+    uint64_t         view_bytes;
+    uint64_t         start;
+    double           copy_ns;
+    double           view_ns;
+
+    memset(data, 0xA5, sizeof(data));
+    memset(&view, 0, sizeof(view));
+
+    printf("Bytes copied per delivered packet\n");
+    printf("%8s %14s %14s %14s %14s\n", "payload", "copy bytes", "view bytes", "copy ns/pkt", "view ns/pkt");
+
+    for (uint32_t s = 0; s < sizeof(m_sizes) / sizeof(m_sizes[0]); s++)
+    {
+        fifo_init(&m_fifo);
+        copy_bytes = 0;
+        start      = time_ns();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            (void)fifo_put_pkt(&m_fifo, 0, data, m_sizes[s]);
+
+            len = sizeof(tx_payload.data);
+            (void)fifo_peek_pkt(&m_fifo, &pipe, tx_payload.data, &len);
+            copy_bytes += len;
+
+            len = sizeof(scratch);
+            (void)fifo_get_pkt(&m_fifo, &pipe, scratch, &len);
+            copy_bytes += len;
+            m_sink += tx_payload.data[0] + scratch[0];
+        }
+        copy_ns = (double)(time_ns() - start) / BENCH_ITERATIONS;
+
+        fifo_init(&m_fifo);
+        view_bytes = 0;
+        start      = time_ns();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            (void)fifo_put_pkt(&m_fifo, 0, data, m_sizes[s]);
+
+            (void)fifo_peek_view(&m_fifo, &view);
+            memcpy(tx_payload.data, view.span[0].p_data, view.span[0].len);
+            if (view.span_cnt > 1)
+            {
+                memcpy(&tx_payload.data[view.span[0].len], view.span[1].p_data, view.span[1].len);
+            }
+            view_bytes += view.hdr.length;
+
+            (void)fifo_consume_view(&m_fifo, &view);
+            m_sink += tx_payload.data[0];
+        }
+        view_ns = (double)(time_ns() - start) / BENCH_ITERATIONS;
+
+        printf("%8u %14.1f %14.1f %14.1f %14.1f\n",
+               m_sizes[s],
+               (double)copy_bytes / BENCH_ITERATIONS,
+               (double)view_bytes / BENCH_ITERATIONS,
+               copy_ns,
+               view_ns);
+    }
+    printf("\n");
+}
+
+
+/* Cost of queueing one packet: the byte by byte copy of the legacy FIFO against the bulk copy of
+ * fifo_put_pkt, for each payload size and position relative to the end of the buffer. */
+static void bench_put(void)
+{
+    uint8_t  data[FIFO_PKT_MAX_LEN];
+    uint32_t offset;
+    uint64_t start_ns;
+    uint64_t start_cycles;
+    double   legacy_ns;
+    double   legacy_cycles;
+    double   bulk_ns;
+    double   bulk_cycles;
+
+    memset(data, 0x3C, sizeof(data));
+
+    printf("Queueing one packet, legacy byte loop against bulk copy%s\n",
+           (cycles() == 0) ? " (no cycle counter on this host)" : "");
+    printf("%8s %8s %14s %14s %14s %14s\n", "payload", "wrap", "legacy ns/B", "bulk ns/B", "legacy cyc/pkt", "bulk cyc/pkt");
+
+    for (uint32_t s = 0; s < sizeof(m_copy_sizes) / sizeof(m_copy_sizes[0]); s++)
+    {
+        for (uint32_t w = 0; w < sizeof(m_wrap_offsets) / sizeof(m_wrap_offsets[0]); w++)
+        {
+            offset = (m_wrap_offsets[w] == 0) ? 0 : (BENCH_FIFO_SIZE - m_wrap_offsets[w]);
+
+            start_ns     = time_ns();
+            start_cycles = cycles();
+            for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+            {
+                legacy_fifo_init(&m_legacy_fifo);
+                m_legacy_fifo.end_idx = offset;
+                (void)legacy_fifo_put_pkt(&m_legacy_fifo, data, m_copy_sizes[s]);
+                m_sink += m_legacy_fifo.end_idx;
+            }
+            legacy_cycles = (double)(cycles() - start_cycles) / BENCH_ITERATIONS;
+            legacy_ns     = (double)(time_ns() - start_ns) / BENCH_ITERATIONS;
+
+            start_ns     = time_ns();
+            start_cycles = cycles();
+            for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+            {
+                fifo_idx_set(&m_fifo, offset);
+                (void)fifo_put_pkt(&m_fifo, 0, data, m_copy_sizes[s]);
+                m_sink += m_fifo.commit_idx;
+            }
+            bulk_cycles = (double)(cycles() - start_cycles) / BENCH_ITERATIONS;
+            bulk_ns     = (double)(time_ns() - start_ns) / BENCH_ITERATIONS;
+
+            printf("%8u %8u %14.2f %14.2f %14.0f %14.0f\n",
+                   m_copy_sizes[s],
+                   m_wrap_offsets[w],
+                   legacy_ns / m_copy_sizes[s],
+                   bulk_ns / m_copy_sizes[s],
+                   legacy_cycles,
+                   bulk_cycles);
+        }
+    }
+    printf("\n");
+}
+
+
+/* Cost per packet of BENCH_BATCH packets queued and taken out one by one, and with a single
+ * fifo_put_many and fifo_get_many. */
+static void bench_batch(void)
+{
+    uint8_t    data[BENCH_BATCH][ESB_MAX_PAYLOAD_LENGTH];
+    uint8_t    out[BENCH_BATCH][ESB_MAX_PAYLOAD_LENGTH];
+    fifo_pkt_t pkts[BENCH_BATCH];
+    uint8_t    pipe;
+    uint32_t   len;
+    uint64_t   start_ns;
+    uint64_t   start_cycles;
+    double     single_ns;
+    double     single_cycles;
+    double     batch_ns;
+    double     batch_cycles;
+
+    memset(data, 0x69, sizeof(data));
+
+    printf("Queueing and taking out %u packets, one by one against put_many/get_many\n", BENCH_BATCH);
+    printf("%8s %14s %14s %14s %14s\n", "payload", "single ns/pkt", "batch ns/pkt", "single cyc/pkt", "batch cyc/pkt");
+
+    for (uint32_t s = 0; s < sizeof(m_sizes) / sizeof(m_sizes[0]); s++)
+    {
+        fifo_init(&m_fifo);
+        start_ns     = time_ns();
+        start_cycles = cycles();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            for (uint32_t p = 0; p < BENCH_BATCH; p++)
+            {
+                (void)fifo_put_pkt(&m_fifo, 0, data[p], m_sizes[s]);
+            }
+            for (uint32_t p = 0; p < BENCH_BATCH; p++)
+            {
+                len = sizeof(out[p]);
+                (void)fifo_get_pkt(&m_fifo, &pipe, out[p], &len);
+            }
+            m_sink += out[0][0];
+        }
+        single_cycles = (double)(cycles() - start_cycles) / (BENCH_ITERATIONS * BENCH_BATCH);
+        single_ns     = (double)(time_ns() - start_ns) / (BENCH_ITERATIONS * BENCH_BATCH);
+
+        fifo_init(&m_fifo);
+        start_ns     = time_ns();
+        start_cycles = cycles();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            for (uint32_t p = 0; p < BENCH_BATCH; p++)
+            {
+                pkts[p].p_data = data[p];
+                pkts[p].length = (uint8_t)m_sizes[s];
+                pkts[p].pipe   = 0;
+                pkts[p].key    = 0;
+                pkts[p].time   = i;
+                pkts[p].id     = i;
+            }
+            (void)fifo_put_many(&m_fifo, pkts, BENCH_BATCH);
+            for (uint32_t p = 0; p < BENCH_BATCH; p++)
+            {
+                pkts[p].p_data = out[p];
+                pkts[p].length = sizeof(out[p]);
+            }
+            (void)fifo_get_many(&m_fifo, pkts, BENCH_BATCH);
+            m_sink += out[0][0];
+        }
+        batch_cycles = (double)(cycles() - start_cycles) / (BENCH_ITERATIONS * BENCH_BATCH);
+        batch_ns     = (double)(time_ns() - start_ns) / (BENCH_ITERATIONS * BENCH_BATCH);
+
+        printf("%8u %14.1f %14.1f %14.0f %14.0f\n", m_sizes[s], single_ns, batch_ns, single_cycles, batch_cycles);
+    }
+    printf("\n");
+}
+
+
+int main(void)
+{
+    bench_records();
+    bench_zero_copy();
+    bench_put();
+    bench_batch();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,267 @@
+/* Host stress test for fifo.h.
+ *
+ * Several producer threads queue packets into one FIFO while a single consumer thread takes them
+ * out, with fifo_put_pkt/fifo_put_many on one side and fifo_get_pkt/fifo_peek_view/fifo_get_many
+ * on the other. Each producer uses its own pipe number and stamps its packets with a sequence
+ * number in the time field, so the consumer can check that every packet arrives once, in order,
+ * and with the right content. The FIFO under test is the first of a FIFO_ARRAY_DEF array; the
+ * storage of the second one must stay untouched.
+ *
+ * Build and run with "make test".
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fifo.h"
+
+#define PRODUCER_COUNT      4
+#define PKTS_PER_PRODUCER   200000
+#define BATCH_MAX           4
+#define GUARD_PATTERN       0xA5A5A5A5UL
+#define STRESS_FIFO_SIZE    256
+
+FIFO_ARRAY_DEF(m_fifos, 2, STRESS_FIFO_SIZE);
+
+static volatile int m_failed = 0;
+static uint32_t     m_full_cnt = 0;         /**< Puts refused because the FIFO was full. */
+
+#define CHECK(cond, ...)                                                                        \
+    do                                                                                          \
+    {                                                                                           \
+        if (!(cond))                                                                            \
+        {                                                                                       \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                     \
+            fprintf(stderr, __VA_ARGS__);                                                       \
+            fprintf(stderr, "\n");                                                              \
+            m_failed = 1;                                                                       \
+        }                                                                                       \
+    } while (0)
+
+
+/* Payload length of a packet, varied so records of all sizes wrap at all offsets. */
+static uint8_t pkt_len(uint32_t producer, uint32_t seq)
+{
+    return (uint8_t)((seq * 7 + producer * 13) % 33);
+}
+
+
+static uint8_t pkt_byte(uint32_t producer, uint32_t seq, uint32_t i)
+{
+    return (uint8_t)(producer * 31 + seq * 17 + i);
+}
+
+
+static void pkt_fill(uint32_t producer, uint32_t seq, uint8_t * p_buf, fifo_pkt_t * p_pkt)
+{
+    p_pkt->p_data = p_buf;
+    p_pkt->length = pkt_len(producer, seq);
+    p_pkt->pipe   = (uint8_t)producer;
+    p_pkt->key    = 0;
+    p_pkt->time   = seq;
+    p_pkt->id     = ~seq;
+
+    for (uint32_t i = 0; i < p_pkt->length; i++)
+    {
+        p_buf[i] = pkt_byte(producer, seq, i);
+    }
+}
+
+
+static void pkt_check(uint32_t * p_next_seq, uint8_t pipe, uint32_t seq, uint8_t const * p_data, uint32_t len)
+{
+    CHECK(pipe < PRODUCER_COUNT, "bad pipe %u", pipe);
+    if (pipe >= PRODUCER_COUNT)
+    {
+        return;
+    }
+
+    CHECK(seq == p_next_seq[pipe], "pipe %u: got packet %u, expected %u", pipe, seq, p_next_seq[pipe]);
+    CHECK(len == pkt_len(pipe, seq), "pipe %u packet %u: length %u", pipe, seq, len);
+
+    for (uint32_t i = 0; i < len && i < pkt_len(pipe, seq); i++)
+    {
+        CHECK(p_data[i] == pkt_byte(pipe, seq, i), "pipe %u packet %u: byte %u differs", pipe, seq, i);
+    }
+
+    p_next_seq[pipe] = seq + 1;
+}
+
+
+static void * producer_thread(void * p_arg)
+{
+    uint32_t   producer = (uint32_t)(uintptr_t)p_arg;
+    uint32_t   seq      = 0;
+    uint8_t    bufs[BATCH_MAX][FIFO_PKT_MAX_LEN];
+    fifo_pkt_t pkts[BATCH_MAX];
+    uint32_t   num_pkts;
+
+    while (seq < PKTS_PER_PRODUCER && !m_failed)
+    {
+        num_pkts = 1 + (seq % BATCH_MAX);
+        if (num_pkts > PKTS_PER_PRODUCER - seq)
+        {
+            num_pkts = PKTS_PER_PRODUCER - seq;
+        }
+
+        for (uint32_t i = 0; i < num_pkts; i++)
+        {
+            pkt_fill(producer, seq + i, bufs[i], &pkts[i]);
+        }
+
+        if (fifo_put_many(&m_fifos[0], pkts, num_pkts))
+        {
+            seq += num_pkts;
+        }
+        else
+        {
+            /* Full: let the consumer run on single core hosts. */
+            __atomic_fetch_add(&m_full_cnt, 1, __ATOMIC_RELAXED);
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+
+static void * consumer_thread(void * p_arg)
+{
+    uint32_t        next_seq[PRODUCER_COUNT] = {0};
+    uint32_t        total = 0;
+    uint32_t        round = 0;
+    uint8_t         bufs[BATCH_MAX][FIFO_PKT_MAX_LEN];
+    uint8_t         flat[FIFO_PKT_MAX_LEN];
+    fifo_pkt_t      pkts[BATCH_MAX];
+    fifo_pkt_view_t view;
+    uint32_t        got;
+
+    (void)p_arg;
+
+    while (total < PRODUCER_COUNT * PKTS_PER_PRODUCER && !m_failed)
+    {
+        switch (round++ % 2)
+        {
+            case 0:
+                /* Read in place, then consume. */
+                if (fifo_peek_view(&m_fifos[0], &view))
+                {
+                    memcpy(flat, view.span[0].p_data, view.span[0].len);
+                    if (view.span_cnt > 1)
+                    {
+                        memcpy(&flat[view.span[0].len], view.span[1].p_data, view.span[1].len);
+                    }
+                    CHECK(view.hdr.id == ~view.hdr.time, "packet %u: bad id", view.hdr.time);
+                    pkt_check(next_seq, view.hdr.pipe, view.hdr.time, flat, view.hdr.length);
+                    CHECK(fifo_consume_view(&m_fifos[0], &view), "consume_view failed");
+                    total++;
+                }
+                else
+                {
+                    sched_yield();
+                }
+                break;
+
+            default:
+                for (uint32_t i = 0; i < BATCH_MAX; i++)
+                {
+                    pkts[i].p_data = bufs[i];
+                    pkts[i].length = FIFO_PKT_MAX_LEN;
+                }
+                got = fifo_get_many(&m_fifos[0], pkts, BATCH_MAX);
+                for (uint32_t i = 0; i < got; i++)
+                {
+                    CHECK(pkts[i].id == ~pkts[i].time, "packet %u: bad id", pkts[i].time);
+                    pkt_check(next_seq, pkts[i].pipe, pkts[i].time, pkts[i].p_data, pkts[i].length);
+                }
+                total += got;
+                break;
+        }
+    }
+
+    CHECK(fifo_num_elem_get(&m_fifos[0]) == 0, "%u bytes left", fifo_num_elem_get(&m_fifos[0]));
+
+    return NULL;
+}
+
+
+/* Single threaded: a packet of each length at each offset, read back with fifo_get_pkt. */
+static void wrap_test(void)
+{
+    uint8_t  buf[FIFO_PKT_MAX_LEN];
+    uint8_t  out[FIFO_PKT_MAX_LEN];
+    uint8_t  pipe = 0;
+    uint32_t len;
+
+    for (uint32_t offset = 0; offset < STRESS_FIFO_SIZE; offset += 4)
+    {
+        for (uint32_t pkt = 0; pkt < STRESS_FIFO_SIZE - sizeof(fifo_pkt_hdr_t); pkt++)
+        {
+            fifo_init(&m_fifos[0]);
+            m_fifos[0].claim      = offset << FIFO_CLAIM_IDX_Pos;
+            m_fifos[0].commit_idx = offset;
+            m_fifos[0].start_idx  = offset;
+
+            for (uint32_t i = 0; i < pkt; i++)
+            {
+                buf[i] = (uint8_t)(offset + pkt + i);
+            }
+
+            if (FIFO_PKT_REC_LEN(pkt) > STRESS_FIFO_SIZE)
+            {
+                CHECK(!fifo_put_pkt(&m_fifos[0], 1, buf, pkt), "oversized packet queued");
+                continue;
+            }
+
+            CHECK(fifo_put_pkt(&m_fifos[0], 1, buf, pkt), "put of %u bytes at %u failed", pkt, offset);
+
+            len = sizeof(out);
+            CHECK(fifo_get_pkt(&m_fifos[0], &pipe, out, &len), "get at %u failed", offset);
+            CHECK(len == pkt && pipe == 1 && memcmp(buf, out, pkt) == 0,
+                  "packet of %u bytes at %u corrupted", pkt, offset);
+        }
+    }
+}
+
+
+int main(void)
+{
+    pthread_t producers[PRODUCER_COUNT];
+    pthread_t consumer;
+
+    FIFO_ARRAY_INIT(m_fifos);
+    for (uint32_t i = 0; i < STRESS_FIFO_SIZE / sizeof(uint32_t); i++)
+    {
+        m_fifos_buf[1][i] = GUARD_PATTERN;
+    }
+
+    wrap_test();
+
+    fifo_init(&m_fifos[0]);
+    pthread_create(&consumer, NULL, consumer_thread, NULL);
+    for (uint32_t i = 0; i < PRODUCER_COUNT; i++)
+    {
+        pthread_create(&producers[i], NULL, producer_thread, (void *)(uintptr_t)i);
+    }
+    for (uint32_t i = 0; i < PRODUCER_COUNT; i++)
+    {
+        pthread_join(producers[i], NULL);
+    }
+    pthread_join(consumer, NULL);
+
+    for (uint32_t i = 0; i < STRESS_FIFO_SIZE / sizeof(uint32_t); i++)
+    {
+        CHECK(m_fifos_buf[1][i] == GUARD_PATTERN, "neighbouring FIFO overwritten at word %u", i);
+    }
+
+    printf("fifo_stress: %s, %u packets, %u full, max %u of %u bytes used\n",
+           m_failed ? "FAILED" : "passed",
+           PRODUCER_COUNT * PKTS_PER_PRODUCER,
+           m_full_cnt,
+           m_fifos[0].max_used,
+           STRESS_FIFO_SIZE);
+
+    return m_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,409 @@
+/* Host simulation of timeslot sizing.
+ *
+ * Compares fixed 5 ms timeslots and extensions with timeslots and extensions sized from the Tx
+ * backlog, with and without BLE-aware placement. Each policy is a set of esb_timeslot.c settings
+ * (TS_LEN_MIN/MAX_US, TX_LEN_EXTENSION_MIN/MAX_US, TX_LEN_EXTENSION_GROWTH_MAX,
+ * esb_timeslot_ble_aware_set), run through the same logic as timeslot_len_get,
+ * extension_needed, extension_len_get and ble_gap_get: a timeslot is only extended while data is
+ * queued, and the extension doubles while the backlog persists. UART lines arrive at random, are
+ * split into ESB payloads and are sent in timeslots that the SoftDevice places between the
+ * connection events of one BLE link. An extension that would run into a connection event fails
+ * and ends the timeslot. A timeslot that is not extended ends, and the next one is requested.
+ *
+ * "fixed" is the default in esb_timeslot.c. Sizing from the backlog and BLE-aware placement are
+ * opt-in, because at high load they leave more of each gap between connection events unused.
+ *
+ * For each load the simulation prints the ESB throughput and latency, and the radio time held
+ * for ESB, which other BLE activity such as advertising or a second link cannot use. Packets are
+ * never lost on air, so every attempt succeeds.
+ *
+ * Build and run with "make sim".
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_TIME_US             (20ULL * 1000000ULL)
+#define SIM_PKTS_MAX            200000
+#define SIM_LATENCY_HIST_LEN    10000                   /**< Latency histogram buckets of 1 ms. */
+
+#define BLE_INTERVAL_US         30000UL                 /**< Connection interval. */
+#define BLE_EVENT_US            7500UL                  /**< Radio time reserved per connection event, NRF_SDH_BLE_GAP_EVENT_LENGTH of 6. */
+
+#define ESB_PAYLOAD_MAX         32                      /**< NRF_ESB_MAX_PAYLOAD_LENGTH. */
+#define LINE_LEN_MIN            20
+#define LINE_LEN_MAX            244                     /**< Longest UART line, one NUS notification. */
+
+#define REQUEST_LATENCY_US      100UL                   /**< Earliest a requested timeslot can start. */
+#define SLOT_SETUP_US           200UL                   /**< UESB start-up at the beginning of a timeslot. */
+#define TS_SAFETY_MARGIN_US     700UL
+#define TS_EXTEND_MARGIN_US     2000UL
+#define TS_PERIOD_GUARD_US      1000UL                  /**< Margin before a connection event, the drift of a fresh anchor is negligible. */
+#define TS_BLE_REQUEST_LEAD_US  1500UL
+#define TS_LEN_MIN_US           3000UL                  /**< Shortest timeslot ble_gap_get places in a gap, as in esb_timeslot.c. */
+#define BACKLOG_MAX_US          128000UL                /**< Longest backlog estimate needed, above every extension length. */
+
+#define MIN(a, b)               (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)               (((a) > (b)) ? (a) : (b))
+
+typedef struct
+{
+    char const * name;
+    uint32_t     ts_len_min_us;
+    uint32_t     ts_len_max_us;
+    uint32_t     ext_min_us;
+    uint32_t     ext_max_us;
+    uint32_t     ext_growth_max;
+    int          ble_aware;
+} policy_t;
+
+typedef struct
+{
+    uint64_t arrival;
+    uint32_t len;
+} pkt_t;
+
+typedef struct
+{
+    uint64_t delivered_bytes;
+    uint64_t delivered_pkts;
+    uint64_t latency_sum_us;
+    uint64_t latency_max_us;
+    uint32_t latency_hist[SIM_LATENCY_HIST_LEN];
+    uint64_t held_us;           /**< Radio time in timeslots. */
+    uint64_t tx_us;             /**< Of that, time spent sending. */
+    uint32_t slots;
+    uint32_t ext_requested;
+    uint32_t ext_failed;
+} result_t;
+
+static policy_t const m_policies[] =
+{
+    { "fixed",   5000, 5000,  5000, 5000,  0, 0 },
+    { "fix+ble", 5000, 5000,  5000, 5000,  0, 1 },
+    { "backlog", 3000, 15000, 2000, 15000, 3, 0 },
+    { "bkl+ble", 3000, 15000, 2000, 15000, 3, 1 },
+};
+static uint32_t const     m_loads_bps[] = { 0, 1000, 5000, 20000, 40000 };   /**< Offered UART load in bytes per second. */
+
+static pkt_t    m_pkts[SIM_PKTS_MAX];
+static uint32_t m_pkt_cnt;
+static uint32_t m_head;         /**< First packet not sent yet. */
+static uint64_t m_rand_state;
+
+
+static uint32_t rand_next(void)
+{
+    m_rand_state = m_rand_state * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    return (uint32_t)(m_rand_state >> 33);
+}
+
+
+/* Uniform in [0, 1). */
+static double rand_unit(void)
+{
+    return (double)rand_next() / 2147483648.0;
+}
+
+
+static uint32_t airtime_us(uint32_t len)
+{
+    /* Ramp-up, packet, turnaround and ACK at 2 Mbps, plus event handling. */
+    return 130 + (9 + len) * 4 + 130 + 9 * 4 + 50;
+}
+
+
+/* Same lines for every policy: Poisson arrivals, each line split into ESB payloads. */
+static void traffic_generate(uint32_t load_bps)
+{
+    double   mean_line = (LINE_LEN_MIN + LINE_LEN_MAX) / 2.0;
+    double   t_us      = 0;
+    uint32_t line_len;
+
+    m_rand_state = 12345;
+    m_pkt_cnt    = 0;
+
+    if (load_bps == 0)
+    {
+        return;
+    }
+
+    while (m_pkt_cnt < SIM_PKTS_MAX - (LINE_LEN_MAX / ESB_PAYLOAD_MAX + 1))
+    {
+        t_us += -log1p(-rand_unit()) * mean_line * 1000000.0 / load_bps;
+        if (t_us >= SIM_TIME_US)
+        {
+            break;
+        }
+
+        line_len = LINE_LEN_MIN + rand_next() % (LINE_LEN_MAX - LINE_LEN_MIN + 1);
+        while (line_len > 0)
+        {
+            m_pkts[m_pkt_cnt].arrival = (uint64_t)t_us;
+            m_pkts[m_pkt_cnt].len     = MIN(line_len, ESB_PAYLOAD_MAX);
+            line_len                 -= m_pkts[m_pkt_cnt].len;
+            m_pkt_cnt++;
+        }
+    }
+}
+
+
+/* Whether [start, start + len) misses every BLE connection event. */
+static int ble_free(uint64_t start, uint32_t len)
+{
+    uint64_t pos = start % BLE_INTERVAL_US;
+
+    return (pos >= BLE_EVENT_US) && (pos + len <= BLE_INTERVAL_US);
+}
+
+
+/* Earliest start at or after t of a timeslot of len that misses the BLE connection events. */
+static uint64_t ble_next_free(uint64_t t, uint32_t len)
+{
+    uint64_t base = t - (t % BLE_INTERVAL_US);
+
+    if (ble_free(t, len))
+    {
+        return t;
+    }
+    if ((t % BLE_INTERVAL_US) < BLE_EVENT_US)
+    {
+        return base + BLE_EVENT_US;
+    }
+
+    return base + BLE_INTERVAL_US + BLE_EVENT_US;
+}
+
+
+/* Radio time needed for the packets queued at time t, like tx_backlog_us. */
+static uint32_t backlog_us(uint64_t t)
+{
+    uint32_t total = 0;
+
+    for (uint32_t i = m_head; i < m_pkt_cnt && m_pkts[i].arrival <= t && total < BACKLOG_MAX_US; i++)
+    {
+        total += airtime_us(m_pkts[i].len);
+    }
+
+    return total;
+}
+
+
+/* Like timeslot_len_get. */
+static uint32_t slot_len_get(policy_t const * p_policy, uint64_t t)
+{
+    return MIN(MAX(backlog_us(t) + TS_SAFETY_MARGIN_US, p_policy->ts_len_min_us), p_policy->ts_len_max_us);
+}
+
+
+/* Like ble_gap_get with a fresh anchor: the connection event and the one after it, plus a margin,
+ * are busy. Returns the start of the first gap at or after t that fits a shortest timeslot, and
+ * its end in *p_end. */
+static uint64_t ble_gap_get(uint64_t t, uint64_t * p_end)
+{
+    uint64_t busy  = 2 * BLE_EVENT_US + TS_PERIOD_GUARD_US;
+    uint64_t phase = t % BLE_INTERVAL_US;
+    uint64_t base  = t - phase;
+    uint64_t start = t;
+
+    if (phase < busy)
+    {
+        start = base + busy;
+    }
+    else if (phase + TS_LEN_MIN_US > BLE_INTERVAL_US - TS_PERIOD_GUARD_US)
+    {
+        base += BLE_INTERVAL_US;
+        start = base + busy;
+    }
+    *p_end = base + BLE_INTERVAL_US - TS_PERIOD_GUARD_US;
+
+    return start;
+}
+
+
+/* Like extension_len_max_get: with BLE-aware placement, the rest of the gap the timeslot ends in. */
+static uint32_t extension_len_max_get(policy_t const * p_policy, uint64_t end)
+{
+    uint64_t gap_end;
+
+    if (!p_policy->ble_aware)
+    {
+        return p_policy->ext_max_us;
+    }
+
+    return (ble_gap_get(end, &gap_end) == end) ? (uint32_t)MIN(gap_end - end, p_policy->ext_max_us) : 0;
+}
+
+
+/* Like extension_len_get, only called while data is queued, as extension_needed requires. */
+static uint32_t extension_len_get(policy_t const * p_policy, uint64_t t, uint64_t end, uint32_t * p_streak)
+{
+    uint32_t len = MAX(backlog_us(t), p_policy->ext_min_us << *p_streak);
+
+    *p_streak = MIN(*p_streak + 1, p_policy->ext_growth_max);
+
+    return MIN(MIN(len, p_policy->ext_max_us), extension_len_max_get(p_policy, end));
+}
+
+
+/* Like extension_needed, without required listening. */
+static int extension_needed(uint64_t t)
+{
+    return backlog_us(t) > 0;
+}
+
+
+/* Sends packets from cur on, starting none after start_limit and finishing all by end.
+ * Returns the time the radio is free again. */
+static uint64_t tx_run(result_t * p_res, uint64_t cur, uint64_t start_limit, uint64_t end)
+{
+    uint64_t latency;
+    uint32_t air;
+
+    while (cur < start_limit && m_head < m_pkt_cnt)
+    {
+        if (m_pkts[m_head].arrival > cur)
+        {
+            /* Idle until the next packet arrives. */
+            cur = MIN(m_pkts[m_head].arrival, start_limit);
+            continue;
+        }
+
+        air = airtime_us(m_pkts[m_head].len);
+        if (cur + air > end)
+        {
+            break;
+        }
+
+        cur                     += air;
+        latency                  = cur - m_pkts[m_head].arrival;
+        p_res->tx_us            += air;
+        p_res->delivered_bytes  += m_pkts[m_head].len;
+        p_res->delivered_pkts   += 1;
+        p_res->latency_sum_us   += latency;
+        p_res->latency_max_us    = MAX(p_res->latency_max_us, latency);
+        p_res->latency_hist[MIN(latency / 1000, SIM_LATENCY_HIST_LEN - 1)]++;
+        m_head++;
+    }
+
+    return MAX(cur, start_limit);
+}
+
+
+static void simulate(policy_t const * p_policy, result_t * p_res)
+{
+    uint64_t t = 0;
+    uint64_t start;
+    uint64_t end;
+    uint64_t gap_end;
+    uint64_t cur;
+    uint32_t len;
+    uint32_t streak;
+
+    m_head = 0;
+
+    while (t < SIM_TIME_US)
+    {
+        len = slot_len_get(p_policy, t);
+        if (p_policy->ble_aware)
+        {
+            /* A normal request placed in the next gap, like configure_next_event_ble. */
+            start = ble_gap_get(t + TS_BLE_REQUEST_LEAD_US, &gap_end);
+            len   = (uint32_t)MIN(len, gap_end - start);
+        }
+        else
+        {
+            start = ble_next_free(t + REQUEST_LATENCY_US, len);
+        }
+        end    = start + len;
+        cur    = start + SLOT_SETUP_US;
+        streak = 0;
+        p_res->slots++;
+
+        for (;;)
+        {
+            /* Up to the "time to extend" timeout. */
+            cur = tx_run(p_res, cur, end - TS_EXTEND_MARGIN_US, end - TS_SAFETY_MARGIN_US);
+
+            if (extension_len_max_get(p_policy, end) < p_policy->ext_min_us ||
+                !extension_needed(end - TS_EXTEND_MARGIN_US))
+            {
+                break;
+            }
+
+            len = extension_len_get(p_policy, end - TS_EXTEND_MARGIN_US, end, &streak);
+            p_res->ext_requested++;
+            if (!ble_free(end, len))
+            {
+                p_res->ext_failed++;
+                break;
+            }
+            end += len;
+        }
+
+        (void)tx_run(p_res, cur, end - TS_SAFETY_MARGIN_US, end - TS_SAFETY_MARGIN_US);
+
+        p_res->held_us += end - start;
+        t               = end;
+    }
+}
+
+
+static uint64_t latency_percentile_ms(result_t const * p_res, uint32_t permille)
+{
+    uint64_t target = (p_res->delivered_pkts * permille + 999) / 1000;
+    uint64_t count  = 0;
+
+    for (uint32_t i = 0; i < SIM_LATENCY_HIST_LEN; i++)
+    {
+        count += p_res->latency_hist[i];
+        if (count >= target && target > 0)
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int main(void)
+{
+    static result_t res;
+    double          seconds = SIM_TIME_US / 1000000.0;
+
+    printf("BLE link: %lu us interval, %lu us reserved per event. %.0f s per run.\n\n",
+           BLE_INTERVAL_US, BLE_EVENT_US, seconds);
+    printf("%8s %8s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+           "load B/s", "policy", "sent B/s", "queued", "lat avg ms", "lat p99 ms",
+           "held %", "held idle%", "slots/s", "ext fail/s");
+
+    for (uint32_t l = 0; l < sizeof(m_loads_bps) / sizeof(m_loads_bps[0]); l++)
+    {
+        traffic_generate(m_loads_bps[l]);
+
+        for (uint32_t p = 0; p < sizeof(m_policies) / sizeof(m_policies[0]); p++)
+        {
+            memset(&res, 0, sizeof(res));
+            simulate(&m_policies[p], &res);
+
+            printf("%8u %8s %10.0f %10u %10.1f %10lu %10.1f %10.1f %10.1f %10.1f\n",
+                   m_loads_bps[l],
+                   m_policies[p].name,
+                   res.delivered_bytes / seconds,
+                   m_pkt_cnt - m_head,
+                   res.delivered_pkts ? (res.latency_sum_us / 1000.0) / res.delivered_pkts : 0.0,
+                   (unsigned long)latency_percentile_ms(&res, 990),
+                   100.0 * res.held_us / SIM_TIME_US,
+                   100.0 * (res.held_us - res.tx_us) / SIM_TIME_US,
+                   res.slots / seconds,
+                   res.ext_failed / seconds);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
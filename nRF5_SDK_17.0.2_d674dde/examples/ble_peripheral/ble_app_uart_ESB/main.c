@@ -63,12 +63,14 @@
 #include "nrf_ble_gatt.h"
 #include "nrf_ble_qwr.h"
 #include "app_timer.h"
+#include "app_scheduler.h"
 #include "ble_nus.h"
 #include "app_uart.h"
 #include "app_util_platform.h"
 #include "bsp_btn_ble.h"
 #include "nrf_pwr_mgmt.h"
 #include "esb_timeslot.h"
+#include "payload_pool.h"
 #if defined (UART_PRESENT)
 #include "nrf_uart.h"
 #endif
@@ -104,6 +106,13 @@
 #define UART_TX_BUF_SIZE                256                                         /**< UART TX buffer size. */
 #define UART_RX_BUF_SIZE                256                                         /**< UART RX buffer size. */
 
+#define SCHED_MAX_EVENT_DATA_SIZE       APP_TIMER_SCHED_EVENT_DATA_SIZE             /**< Maximum size of scheduler events. */
+#define SCHED_QUEUE_SIZE                10                                          /**< Maximum number of events in the scheduler queue. */
+
+#define BLE_TX_QUEUE_LEN                PAYLOAD_POOL_BUF_COUNT                      /**< Maximum number of UART lines waiting to be sent over BLE, must be a power of two. */
+
+STATIC_ASSERT(PAYLOAD_POOL_BUF_SIZE >= BLE_NUS_MAX_DATA_LEN);                       /**< A pool buffer holds a whole UART line. */
+
 
 BLE_NUS_DEF(m_nus, NRF_SDH_BLE_TOTAL_LINK_COUNT);                                   /**< BLE NUS service instance. */
 NRF_BLE_GATT_DEF(m_gatt);                                                           /**< GATT module instance. */
@@ -117,6 +126,15 @@ static ble_uuid_t m_adv_uuids[]          =
     {BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}
 };
 static bool                             m_proprietary_on = false;                   /**< A flag which indicates whether 2.4GHz proprietary protocol is turned on or not. */
+static payload_buf_t *                  m_ble_tx_queue[BLE_TX_QUEUE_LEN];           /**< UART lines waiting to be sent over BLE, oldest first. */
+static volatile uint32_t                m_ble_tx_head    = 0;                       /**< Next line to send. Only written by ble_tx_process. */
+static volatile uint32_t                m_ble_tx_tail    = 0;                       /**< Next free entry. Only written by uart_event_handle. */
+static volatile bool                    m_ble_tx_pending = false;                   /**< Whether ble_tx_process is queued in app_scheduler. */
+static nrf_atomic_u32_t                 m_uart_dropped_bytes  = 0;                  /**< UART bytes lost because no pool buffer was free, up to the end of their line. */
+static nrf_atomic_u32_t                 m_ble_dropped_bytes   = 0;                  /**< UART bytes not sent over BLE because the queue was full or there was no peer. */
+static nrf_atomic_u32_t                 m_esb_failed_lines    = 0;                  /**< UART lines ESB refused to queue. */
+static uint32_t                         m_uart_dropped_logged = 0;                  /**< m_uart_dropped_bytes when last logged. Only used by ble_tx_process. */
+static uint32_t                         m_esb_failed_logged   = 0;                  /**< m_esb_failed_lines when last logged. Only used by ble_tx_process. */
 
 
 /**@brief Function for assert macro callback.
@@ -350,6 +368,80 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
 }
 
 
+/**@brief Function for sending queued UART lines over BLE, in main context.
+ *
+ * @details Lines stay queued while the SoftDevice is out of buffers, and are sent when
+ *          BLE_GATTS_EVT_HVN_TX_COMPLETE runs this again. Without a peer they are released,
+ *          which BLE_GAP_EVT_DISCONNECTED runs this for.
+ */
+static void ble_tx_process(void * p_event_data, uint16_t event_size)
+{
+    uint32_t        err_code;
+    payload_buf_t * p_line;
+    uint16_t        length;
+    uint32_t        dropped = 0;
+
+    m_ble_tx_pending = false;
+
+    while (m_ble_tx_head != m_ble_tx_tail)
+    {
+        p_line = m_ble_tx_queue[m_ble_tx_head % BLE_TX_QUEUE_LEN];
+        length = p_line->length;
+
+        err_code = ble_nus_data_send(&m_nus, p_line->data, &length, m_conn_handle);
+        if (err_code == NRF_ERROR_RESOURCES)
+        {
+            break;
+        }
+        if ((err_code != NRF_ERROR_INVALID_STATE) &&
+            (err_code != NRF_ERROR_NOT_FOUND))
+        {
+            APP_ERROR_CHECK(err_code);
+        }
+
+        // The SoftDevice has copied the data, or there is no peer to send it to.
+        if (err_code != NRF_SUCCESS)
+        {
+            dropped = nrf_atomic_u32_add(&m_ble_dropped_bytes, p_line->length);
+        }
+        payload_buf_release(p_line);
+        m_ble_tx_head++;
+    }
+
+    if (dropped != 0)
+    {
+        NRF_LOG_WARNING("No BLE peer, %u UART bytes dropped in total", dropped);
+    }
+
+    // Counted by uart_event_handle, which must not log once per byte.
+    if (m_uart_dropped_bytes != m_uart_dropped_logged)
+    {
+        m_uart_dropped_logged = m_uart_dropped_bytes;
+        NRF_LOG_WARNING("No buffer for UART data, %u bytes dropped in total", m_uart_dropped_logged);
+    }
+    if (m_esb_failed_lines != m_esb_failed_logged)
+    {
+        m_esb_failed_logged = m_esb_failed_lines;
+        NRF_LOG_WARNING("ESB send failed, %u UART lines not sent over ESB in total", m_esb_failed_logged);
+    }
+}
+
+
+/**@brief Function for running ble_tx_process in main context.
+ */
+static void ble_tx_schedule(void)
+{
+    if (!m_ble_tx_pending)
+    {
+        m_ble_tx_pending = true;
+        if (app_sched_event_put(NULL, 0, ble_tx_process) != NRF_SUCCESS)
+        {
+            m_ble_tx_pending = false;
+        }
+    }
+}
+
+
 /**@brief Function for handling BLE events.
  *
  * @param[in]   p_ble_evt   Bluetooth stack event.
@@ -374,6 +466,13 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             NRF_LOG_INFO("Disconnected");
             // LED indication will be changed when advertising starts.
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
+            // No BLE_GATTS_EVT_HVN_TX_COMPLETE will come, release the lines still queued.
+            ble_tx_schedule();
+            break;
+
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+            // Room for more notifications.
+            ble_tx_schedule();
             break;
 
         case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
@@ -529,50 +628,80 @@ void bsp_event_handler(bsp_event_t event)
 /**@brief   Function for handling app_uart events.
  *
  * @details This function will receive a single character from the app_uart module and append it to
- *          a string. The string will be be sent over BLE when the last character received was a
- *          'new line' '\n' (hex 0x0A) or if the string has reached the maximum data length.
+ *          a string in a pool buffer. The string will be be sent over BLE and ESB when the last
+ *          character received was a 'new line' '\n' (hex 0x0A) or if the string has reached the
+ *          maximum data length. Sending over BLE is finished in main context, so the next string can
+ *          be received meanwhile. Without a free buffer, the rest of the line is dropped and counted,
+ *          and ble_tx_process logs the total.
  */
 /**@snippet [Handling the data received over UART] */
 void uart_event_handle(app_uart_evt_t * p_event)
 {
-    static uint8_t data_array[BLE_NUS_MAX_DATA_LEN];
-    static uint8_t index = 0;
-    uint32_t       err_code;
+    static payload_buf_t * p_line   = NULL;
+    static bool            dropping = false;
+    uint8_t                byte;
+    uint32_t               err_code;
 
     switch (p_event->evt_type)
     {
         case APP_UART_DATA_READY:
-            UNUSED_VARIABLE(app_uart_get(&data_array[index]));
-            index++;
+            UNUSED_VARIABLE(app_uart_get(&byte));
+
+            if (p_line == NULL)
+            {
+                p_line = dropping ? NULL : payload_pool_alloc();
+                if (p_line == NULL)
+                {
+                    // All buffers are still waiting for BLE: drop the rest of the line rather than
+                    // send a part of it.
+                    (void)nrf_atomic_u32_add(&m_uart_dropped_bytes, 1);
+                    if (!dropping)
+                    {
+                        ble_tx_schedule();
+                    }
+                    dropping = (byte != '\n') && (byte != '\r');
+                    break;
+                }
+            }
 
-            if ((data_array[index - 1] == '\n') ||
-                (data_array[index - 1] == '\r') ||
-                (index >= m_ble_nus_max_data_len))
+            p_line->data[p_line->length++] = byte;
+
+            if ((byte == '\n') ||
+                (byte == '\r') ||
+                (p_line->length >= m_ble_nus_max_data_len))
             {
-                if (index > 1)
+                if (p_line->length > 1)
                 {
                     NRF_LOG_DEBUG("Ready to send data over BLE NUS");
-                    NRF_LOG_HEXDUMP_DEBUG(data_array, index);
+                    NRF_LOG_HEXDUMP_DEBUG(p_line->data, p_line->length);
                     // Send UART input packet via ESB and BLE
                     if (m_proprietary_on)
                     {
-                        err_code = esb_timeslot_send_str(data_array, index);
-                        APP_ERROR_CHECK(err_code);
-                    }
-                    do
-                    {
-                        uint16_t length = (uint16_t)index;
-                        err_code = ble_nus_data_send(&m_nus, data_array, &length, m_conn_handle);
-                        if ((err_code != NRF_ERROR_INVALID_STATE) &&
-                            (err_code != NRF_ERROR_RESOURCES) &&
-                            (err_code != NRF_ERROR_NOT_FOUND))
+                        // Copied into the ESB Tx queue, so ESB doesn't keep a reference.
+                        err_code = esb_timeslot_send_str(p_line->data, p_line->length, 0, ESB_TIMESLOT_CLASS_BULK);
+                        if (err_code != NRF_SUCCESS)
                         {
-                            APP_ERROR_CHECK(err_code);
+                            // Still sent over BLE. Logged by ble_tx_process.
+                            (void)nrf_atomic_u32_add(&m_esb_failed_lines, 1);
+                            ble_tx_schedule();
                         }
-                    } while (err_code == NRF_ERROR_RESOURCES);
+                    }
+                    if ((m_ble_tx_tail - m_ble_tx_head) < BLE_TX_QUEUE_LEN)
+                    {
+                        // BLE keeps a reference until the SoftDevice has taken the data.
+                        payload_buf_ref(p_line);
+                        m_ble_tx_queue[m_ble_tx_tail % BLE_TX_QUEUE_LEN] = p_line;
+                        m_ble_tx_tail++;
+                        ble_tx_schedule();
+                    }
+                    else
+                    {
+                        (void)nrf_atomic_u32_add(&m_ble_dropped_bytes, p_line->length);
+                    }
                 }
 
-                index = 0;
+                payload_buf_release(p_line);
+                p_line = NULL;
             }
             break;
 
@@ -680,6 +809,23 @@ static void log_init(void)
 }
 
 
+/**@brief Function for initializing the event scheduler.
+ */
+static void scheduler_init(void)
+{
+    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+}
+
+
+/**@brief Function for initializing the buffers shared by UART, BLE and ESB.
+ */
+static void payload_buffers_init(void)
+{
+    ret_code_t err_code = payload_pool_init();
+    APP_ERROR_CHECK(err_code);
+}
+
+
 /**@brief Function for initializing power management.
  */
 static void power_management_init(void)
@@ -692,10 +838,12 @@ static void power_management_init(void)
 
 /**@brief Function for handling the idle state (main loop).
  *
- * @details If there is no pending log operation, then sleep until next the next event occurs.
+ * @details Handles any pending scheduler events. If there is no pending log operation, then sleep
+ *          until next the next event occurs.
  */
 static void idle_state_handle(void)
 {
+    app_sched_execute();
     if (NRF_LOG_PROCESS() == false)
     {
         nrf_pwr_mgmt_run();
@@ -727,6 +875,10 @@ static void esb_timeslot_start(void)
     err_code = esb_timeslot_init(esb_timeslot_data_handler);
     APP_ERROR_CHECK(err_code);
 
+    // Keep the most recent UART data if the radio falls behind.
+    err_code = esb_timeslot_overflow_policy_set(ESB_TIMESLOT_CLASS_BULK, ESB_TIMESLOT_OVERFLOW_DROP_OLDEST, 0);
+    APP_ERROR_CHECK(err_code);
+
     err_code = esb_timeslot_sd_start();
     APP_ERROR_CHECK(err_code);
 
@@ -740,6 +892,8 @@ int main(void)
     bool erase_bonds;
 
     // Initialize.
+    scheduler_init();
+    payload_buffers_init();
     uart_init();
     log_init();
     timers_init();